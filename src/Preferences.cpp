@@ -28,6 +28,8 @@
   #include "Preferences_impl_dct.h"
 #elif defined(NVS_USE_SFUD)
   #include "Preferences_impl_sfud.h"
+#elif defined(NVS_PACKED)
+  #include "Preferences_impl_packed.h"
 #else
   #include "Preferences_impl_fs.h"
 #endif
@@ -35,10 +37,623 @@
 Preferences::Preferences()
     : _started(false)
     , _readOnly(false)
+    , _inTransaction(false)
+    , _txnData(NULL)
+    , _txnSize(0)
+    , _cache(NULL)
+    , _cacheSize(0)
+    , _cacheUsed(0)
+    , _cacheHits(0)
+    , _cacheMisses(0)
+#if defined(NVS_PACKED)
+    , _table(NULL)
+    , _tableSize(0)
+    , _tableGen(0)
+    , _genSlot(0)
+#if defined(NVS_PACKED_MMAP)
+    , _tableMapped(false)
+    , _mapIno(0)
+    , _mapTime(0)
+    , _mapCheck(0)
+#endif
+#endif
 {}
 
 Preferences::~Preferences(){
     end();
+    free(_cache);
+}
+
+/*
+ * Transactions: until commit(), put*() calls are kept in RAM as a list of
+ * [key\0][length:4][value] entries. Putting a key again replaces its entry.
+ * They're only available where putEntries() is all-or-nothing (NVS_ATOMIC_BATCH).
+ * */
+
+bool Preferences::beginTransaction(){
+#if defined(NVS_ATOMIC_BATCH)
+    return _txnBegin();
+#else
+    LOG_E("transactions aren't atomic on this backend");
+    return false;
+#endif
+}
+
+bool Preferences::_txnBegin(){
+    if (!_started || _readOnly || _inTransaction) {
+        return false;
+    }
+    _inTransaction = true;
+    return true;
+}
+
+void Preferences::rollback(){
+    free(_txnData);
+    _txnData = NULL;
+    _txnSize = 0;
+    _inTransaction = false;
+}
+
+bool Preferences::commit(){
+    if (!_inTransaction) {
+        return false;
+    }
+    _inTransaction = false; // write through from now on
+
+    size_t count = 0;
+    for (size_t off = 0; off < _txnSize; count++) {
+        uint32_t len;
+        off += strlen((const char*)_txnData + off) + 1;
+        memcpy(&len, _txnData + off, sizeof(len));
+        off += sizeof(len) + len;
+    }
+
+    bool ok = true;
+    if (count) {
+        PreferenceEntry* entries = (PreferenceEntry*)malloc(count * sizeof(PreferenceEntry));
+        if (entries) {
+            size_t off = 0;
+            for (size_t i = 0; i < count; i++) {
+                uint32_t len;
+                entries[i].key = (const char*)_txnData + off;
+                off += strlen(entries[i].key) + 1;
+                memcpy(&len, _txnData + off, sizeof(len));
+                off += sizeof(len);
+                entries[i].value  = _txnData + off;
+                entries[i].length = len;
+                off += len;
+            }
+            ok = (putEntries(entries, count) == count);
+            free(entries);
+        } else {
+            LOG_E("not enough memory to commit");
+            ok = false;
+        }
+    }
+    rollback();
+    return ok;
+}
+
+size_t Preferences::_txnPut(const char* key, const void* buf, size_t len){
+    size_t   ksize = strlen(key) + 1;
+    uint32_t vsize = len;
+    uint8_t* data  = (uint8_t*)realloc(_txnData, _txnSize + ksize + sizeof(vsize) + len);
+    if (!data) {
+        LOG_E("not enough memory to buffer %s", key);
+        return 0;
+    }
+    _txnData = data;
+
+    // Drop the previous value of this key
+    for (size_t off = 0; off < _txnSize; ) {
+        size_t   k = strlen((const char*)_txnData + off) + 1;
+        uint32_t v;
+        memcpy(&v, _txnData + off + k, sizeof(v));
+        size_t   n = k + sizeof(v) + v;
+        if (!strcmp((const char*)_txnData + off, key)) {
+            memmove(_txnData + off, _txnData + off + n, _txnSize - off - n);
+            _txnSize -= n;
+            break;
+        }
+        off += n;
+    }
+
+    memcpy(_txnData + _txnSize, key, ksize);
+    memcpy(_txnData + _txnSize + ksize, &vsize, sizeof(vsize));
+    if (len) {
+        memcpy(_txnData + _txnSize + ksize + sizeof(vsize), buf, len);
+    }
+    _txnSize += ksize + sizeof(vsize) + len;
+    return len;
+}
+
+/*
+ * Read cache: values returned by getBytes(), getString() and the typed
+ * getters are kept in RAM as a list of [key\0][length:4][value] entries,
+ * least recently used first, in up to `size` bytes. isKey() and
+ * getBytesLength() are answered from it too. Writes through this object
+ * update it; writes through another object on the same namespace don't.
+ * */
+
+bool Preferences::setCacheSize(size_t size){
+    free(_cache);
+    _cache = NULL;
+    _cacheSize = 0;
+    _cacheUsed = 0;
+    _cacheHits = 0;
+    _cacheMisses = 0;
+    if (!size) {
+        return true;
+    }
+    _cache = (uint8_t*)malloc(size);
+    if (!_cache) {
+        LOG_E("not enough memory for the cache");
+        return false;
+    }
+    _cacheSize = size;
+    return true;
+}
+
+static size_t _cache_entry_size(const uint8_t* e){
+    size_t   k = strlen((const char*)e) + 1;
+    uint32_t v;
+    memcpy(&v, e + k, sizeof(v));
+    return k + sizeof(v) + v;
+}
+
+static void _cache_reverse(uint8_t* p, size_t len){
+    for (size_t i = 0; i < len / 2; i++) {
+        uint8_t t = p[i];
+        p[i] = p[len - 1 - i];
+        p[len - 1 - i] = t;
+    }
+}
+
+size_t Preferences::_cacheFind(const char* key){
+    size_t off = 0;
+    while (off < _cacheUsed && strcmp((const char*)_cache + off, key)) {
+        off += _cache_entry_size(_cache + off);
+    }
+    return off;
+}
+
+void Preferences::_cacheDrop(const char* key){
+    if (!_cacheUsed || !key) {
+        return;
+    }
+    size_t off = _cacheFind(key);
+    if (off < _cacheUsed) {
+        size_t n = _cache_entry_size(_cache + off);
+        memmove(_cache + off, _cache + off + n, _cacheUsed - off - n);
+        _cacheUsed -= n;
+    }
+}
+
+void Preferences::_cachePut(const char* key, const void* buf, size_t len){
+    size_t   ksize = strlen(key) + 1;
+    uint32_t vsize = len;
+    size_t   n     = ksize + sizeof(vsize) + len;
+    if (n > _cacheSize) {
+        return;
+    }
+    // Evict the least recently used entries
+    size_t evict = 0;
+    while (_cacheUsed - evict + n > _cacheSize) {
+        evict += _cache_entry_size(_cache + evict);
+    }
+    memmove(_cache, _cache + evict, _cacheUsed - evict);
+    _cacheUsed -= evict;
+
+    memcpy(_cache + _cacheUsed, key, ksize);
+    memcpy(_cache + _cacheUsed + ksize, &vsize, sizeof(vsize));
+    memcpy(_cache + _cacheUsed + ksize + sizeof(vsize), buf, len);
+    _cacheUsed += n;
+}
+
+// Returns the cached value of `key` and counts a hit, or NULL and counts a miss
+const uint8_t* Preferences::_cacheGet(const char* key, size_t* len){
+    size_t off = _cacheFind(key);
+    if (off >= _cacheUsed) {
+        _cacheMisses++;
+        return NULL;
+    }
+    _cacheHits++;
+    // Move the entry to the end, as the most recently used one
+    size_t n = _cache_entry_size(_cache + off);
+    _cache_reverse(_cache + off, n);
+    _cache_reverse(_cache + off + n, _cacheUsed - off - n);
+    _cache_reverse(_cache + off, _cacheUsed - off);
+
+    const uint8_t* e = _cache + _cacheUsed - n;
+    size_t   ksize = strlen((const char*)e) + 1;
+    uint32_t vsize;
+    memcpy(&vsize, e + ksize, sizeof(vsize));
+    *len = vsize;
+    return e + ksize + sizeof(vsize);
+}
+
+size_t Preferences::getBytes(const char* key, void * buf, size_t maxLen){
+    if(!_started || !key){
+        return 0;
+    }
+    if (!_cache) {
+        return _getBytes(key, buf, maxLen);
+    }
+
+    size_t len;
+    const uint8_t* v = _cacheGet(key, &len);
+    if (v) {
+        if(!buf || !maxLen){
+            return len;
+        }
+        if(len > maxLen){
+            return 0;
+        }
+        memcpy(buf, v, len);
+        return len;
+    }
+
+    len = _getBytes(key, buf, maxLen);
+    if (len && buf && maxLen) {
+        _cachePut(key, buf, len);
+    }
+    return len;
+}
+
+bool Preferences::isKey(const char* key){
+    size_t len;
+    if (_cache && _started && key && _cacheGet(key, &len)) {
+        return true;
+    }
+    return _isKey(key);
+}
+
+size_t Preferences::getBytesLength(const char* key){
+    size_t len;
+    if (_cache && _started && key && _cacheGet(key, &len)) {
+        return len;
+    }
+    return _getBytesLength(key);
+}
+
+size_t Preferences::getString(const char* key, char* value, const size_t maxLen){
+    if (!_cache || !_started || !key || !value || !maxLen) {
+        return _getString(key, value, maxLen);
+    }
+    size_t len;
+    const uint8_t* v = _cacheGet(key, &len);
+    if (v) {
+        if (len > maxLen - 1) {
+            // Doesn't fit: match the ESP32 API and leave the buffer untouched.
+            return 0;
+        }
+        memcpy(value, v, len);
+        value[len] = '\0';
+        return len;
+    }
+    // The backend copies the stored bytes as they are, so they can be cached
+    len = _getString(key, value, maxLen);
+    if (len) {
+        _cachePut(key, value, len);
+    }
+    return len;
+}
+
+String Preferences::getString(const char* key, const String defaultValue){
+    if (!_cache || !_started || !key) {
+        return _getString(key, defaultValue);
+    }
+    char buff[64];
+    size_t len;
+    const uint8_t* v = _cacheGet(key, &len);
+    if (v) {
+        char* str = (len < sizeof(buff)) ? buff : (char*)malloc(len + 1);
+        if (!str) {
+            return defaultValue;
+        }
+        memcpy(str, v, len);
+        str[len] = '\0';
+        String result(str);
+        if (str != buff) {
+            free(str);
+        }
+        return result;
+    }
+    // Short strings are read by the char* getter, so they can be cached
+    len = _getString(key, buff, sizeof(buff));
+    if (len) {
+        _cachePut(key, buff, len);
+        return String(buff);
+    }
+    return _getString(key, defaultValue);
+}
+
+/*
+ * Streams: read or write a value a chunk at a time, for values that
+ * don't fit in RAM. A writer stores its value only once it's complete.
+ * */
+
+PreferenceReader Preferences::openReader(const char* key){
+    PreferenceReader r;
+    if (!_started || !key || !*key || strlen(key) >= sizeof(r._key) || !isKey(key)) {
+        return r;
+    }
+    strcpy(r._key, key);
+    r._size  = getBytesLength(key);
+    r._prefs = this;
+    return r;
+}
+
+size_t PreferenceReader::read(void* buf, size_t len){
+    if (!_prefs || !buf) {
+        return 0;
+    }
+    if (len > _size - _pos) {
+        len = _size - _pos;
+    }
+    size_t n = len ? _prefs->_readAt(_key, _pos, buf, len) : 0;
+    _pos += n;
+    return n;
+}
+
+PreferenceWriter Preferences::openWriter(const char* key, size_t size){
+    PreferenceWriter w;
+    if (!_started || _readOnly || _inTransaction || !key || !*key || strlen(key) >= sizeof(w._key)) {
+        return w;
+    }
+    strcpy(w._key, key);
+    w._size = size;
+    if (_writeOpen(w)) {
+        w._prefs = this;
+    }
+    return w;
+}
+
+PreferenceWriter::PreferenceWriter(PreferenceWriter&& other)
+    : _prefs(other._prefs)
+    , _size(other._size)
+    , _pos(other._pos)
+    , _off(other._off)
+    , _buf(other._buf)
+{
+    memcpy(_key, other._key, sizeof(_key));
+    other._prefs = NULL;
+    other._buf   = NULL;
+}
+
+PreferenceWriter::~PreferenceWriter(){
+    if (_prefs) {
+        _prefs->_writeClose(*this, false); // incomplete, drop it
+    }
+}
+
+size_t PreferenceWriter::write(const void* buf, size_t len){
+    if (!_prefs || !buf || len > _size - _pos) {
+        return 0;
+    }
+    if (len && !_prefs->_writeChunk(*this, buf, len)) {
+        return 0;
+    }
+    _pos += len;
+    return len;
+}
+
+bool PreferenceWriter::close(){
+    if (!_prefs) {
+        return false;
+    }
+    Preferences* prefs = _prefs;
+    _prefs = NULL;
+    bool ok = prefs->_writeClose(*this, _pos == _size);
+    prefs->_cacheDrop(_key);
+    return ok && _pos == _size;
+}
+
+#if defined(NVS_USE_DCT) || defined(NVS_PACKED)
+
+// These backends store a value at once: buffer the stream, then put it
+
+bool Preferences::_writeOpen(PreferenceWriter& w){
+#if defined(NVS_USE_DCT)
+    if (w._size > DCT_VARIABLE_VALUE_SIZE) {
+        return false; // putBytes() would refuse it on close()
+    }
+#endif
+    w._buf = (uint8_t*)malloc(w._size ? w._size : 1);
+    return w._buf != NULL;
+}
+
+bool Preferences::_writeChunk(PreferenceWriter& w, const void* buf, size_t len){
+    memcpy(w._buf + w._pos, buf, len);
+    return true;
+}
+
+bool Preferences::_writeClose(PreferenceWriter& w, bool store){
+    bool ok = !store || putBytes(w._key, w._buf, w._size) == w._size;
+    free(w._buf);
+    w._buf = NULL;
+    return ok;
+}
+
+#endif
+
+/*
+ * Snapshots: a namespace as a binary image
+ *   [magic:4]([key_len:1][val_len:4][key:key_len][val:val_len])...[0][crc32:4]
+ * Lengths are little-endian, the CRC covers all the bytes before it.
+ * */
+
+static const uint8_t NVS_IMAGE_MAGIC[4] = { 'P', 'R', 'F', '1' };
+
+// Largest value importFrom() accepts, so a corrupt length is refused
+// before anything is allocated for it
+#if !defined(NVS_IMPORT_MAX_VALUE)
+  #if defined(NVS_USE_DCT)
+    #define NVS_IMPORT_MAX_VALUE    DCT_VARIABLE_VALUE_SIZE
+  #elif defined(NVS_USE_SFUD)
+    #define NVS_IMPORT_MAX_VALUE    SFUD_NVS_MAX_VALUE
+  #else
+    #define NVS_IMPORT_MAX_VALUE    0xFFFF  // what a packed namespace can hold
+  #endif
+#endif
+
+static uint32_t _crc32(uint32_t crc, const void* buf, size_t len){
+    const uint8_t* p = (const uint8_t*)buf;
+    crc = ~crc;
+    while (len--) {
+        crc ^= *p++;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+struct _ImageWriter {
+    Stream*  out;
+    uint32_t crc;
+    size_t   size;
+    bool     ok;
+    size_t   count;  // keys written in full
+
+    void put(const void* buf, size_t len){
+        if (ok && len && out->write((const uint8_t*)buf, len) != len) {
+            ok = false;
+        }
+        crc   = _crc32(crc, buf, len);
+        size += len;
+    }
+};
+
+static void _put_u32(uint8_t* p, uint32_t v){
+    p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8); p[2] = (uint8_t)(v >> 16); p[3] = (uint8_t)(v >> 24);
+}
+
+static uint32_t _get_u32(const uint8_t* p){
+    return p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static bool _export_entry(const char* key, const void* value, size_t length, void* arg){
+    _ImageWriter* w = (_ImageWriter*)arg;
+    uint8_t hdr[5];
+    hdr[0] = (uint8_t)strlen(key);
+    _put_u32(hdr + 1, length);
+    w->put(hdr, sizeof(hdr));
+    w->put(key, hdr[0]);
+    w->put(value, length);
+    if (w->ok) {
+        w->count++;
+    }
+    return w->ok;
+}
+
+// Returns the size of the image, or 0 on error: no trailer is written after a
+// short write, so the partial image is refused by importFrom()
+size_t Preferences::exportTo(Stream& out){
+    if (!_started) {
+        return 0;
+    }
+    _ImageWriter w = { &out, 0, 0, true, 0 };
+    w.put(NVS_IMAGE_MAGIC, sizeof(NVS_IMAGE_MAGIC));
+    if (!w.ok || forEach(_export_entry, &w) != w.count || !w.ok) {
+        return 0;
+    }
+    uint8_t end[5] = { 0 };
+    _put_u32(end + 1, w.crc);
+    w.put(end, sizeof(end));
+    return w.ok ? w.size : 0;
+}
+
+/*
+ * The image is checked in full before anything is stored, then its keys
+ * are written by a single putEntries() through the transaction buffer.
+ * That buffer holds the whole image, so the import needs up to about twice
+ * its size in heap while it grows. Values over NVS_IMPORT_MAX_VALUE are refused.
+ * Without NVS_ATOMIC_BATCH, a write error can leave part of them stored.
+ * Existing keys that aren't in the image are kept.
+ * Returns the number of keys imported, or 0 on error.
+ * */
+
+size_t Preferences::importFrom(Stream& in){
+    if (!_txnBegin()) {
+        return 0;
+    }
+    uint32_t crc   = 0;
+    size_t   count = 0;
+    uint8_t* value = NULL;
+    size_t   valueSize = 0;
+    bool     ok    = false;
+
+    uint8_t hdr[5];
+    if (in.readBytes((char*)hdr, sizeof(NVS_IMAGE_MAGIC)) == sizeof(NVS_IMAGE_MAGIC) &&
+        !memcmp(hdr, NVS_IMAGE_MAGIC, sizeof(NVS_IMAGE_MAGIC)))
+    {
+        crc = _crc32(crc, hdr, sizeof(NVS_IMAGE_MAGIC));
+        for (;;) {
+            if (in.readBytes((char*)hdr, sizeof(hdr)) != sizeof(hdr)) {
+                break;
+            }
+            if (!hdr[0]) {
+                ok = (_get_u32(hdr + 1) == crc);
+                break;
+            }
+            crc = _crc32(crc, hdr, sizeof(hdr));
+            char   key[16];
+            size_t len = _get_u32(hdr + 1);
+            if (hdr[0] >= sizeof(key) || in.readBytes(key, hdr[0]) != hdr[0]) {
+                break;
+            }
+            key[hdr[0]] = '\0';
+            crc = _crc32(crc, key, hdr[0]);
+            if (len > NVS_IMPORT_MAX_VALUE) {
+                LOG_E("value is too large to import: %s", key);
+                break;
+            }
+            if (len > valueSize) {
+                uint8_t* p = (uint8_t*)realloc(value, len);
+                if (!p) {
+                    LOG_E("not enough memory to import %s", key);
+                    break;
+                }
+                value     = p;
+                valueSize = len;
+            }
+            if (in.readBytes((char*)value, len) != len || _txnPut(key, value, len) != len) {
+                break;
+            }
+            crc = _crc32(crc, value, len);
+            count++;
+        }
+    }
+    free(value);
+
+    if (!ok) {
+        LOG_W("invalid image");
+        rollback();
+        return 0;
+    }
+    return commit() ? count : 0;
+}
+
+/*
+ * I/O counters, shared by all the objects. They're only kept when built
+ * with NVS_STATS (see prefs_io_stats.h), and read as zeros otherwise.
+ * */
+
+PreferenceIoStats Preferences::ioStats(){
+    PreferenceIoStats st;
+#if defined(NVS_STATS)
+    st = gPrefsIoStats;
+#else
+    memset(&st, 0, sizeof(st));
+#endif
+    return st;
+}
+
+void Preferences::resetIoStats(){
+#if defined(NVS_STATS)
+    memset(&gPrefsIoStats, 0, sizeof(gPrefsIoStats));
+#endif
 }
 
 /*
@@ -16,8 +16,123 @@ typedef enum {
     PT_I8, PT_U8, PT_I16, PT_U16, PT_I32, PT_U32, PT_I64, PT_U64, PT_STR, PT_BLOB, PT_INVALID
 } PreferenceType;
 
+typedef struct {
+    const char* key;
+    const void* value;
+    size_t      length;
+} PreferenceEntry;
+
+// Storage figures, see Preferences::stats(). Sizes are in bytes.
+typedef struct {
+    size_t  entries;        // keys in this namespace
+    size_t  bytesUsed;      // taken by them
+    size_t  bytesFree;      // left for new values, shared by all namespaces
+    size_t  deadEntries;    // deleted or outdated records that still take space
+    size_t  deadBytes;
+    size_t  blockSize;      // allocation unit of the storage, 0 if unknown
+    size_t  blocksTotal;
+    size_t  blocksUsed;
+    uint8_t fragmentation;  // % of the bytes taken that are dead, until they're reclaimed
+} PreferenceStats;
+
+// Storage I/O of all the objects, see Preferences::ioStats() (needs NVS_STATS)
+typedef struct {
+    uint32_t calls;
+    uint64_t bytes;
+    uint64_t micros;        // time spent in the calls
+} PreferenceIoCounter;
+
+typedef struct {
+    PreferenceIoCounter read;   // reads, and compares of unchanged values
+    PreferenceIoCounter write;  // writes and appends
+    PreferenceIoCounter erase;  // file deletes, flash erases, DCT deletes
+    PreferenceIoCounter meta;   // lookups, renames, directory listings, setup
+} PreferenceIoStats;
+
+// Called by Preferences::forEach() for each key, return false to stop
+typedef bool (*PreferenceCallback)(const char* key, const void* value, size_t length, void* arg);
+
+/*
+ * A key bound to the type of its value, for the typed get()/put():
+ *   static constexpr PreferenceKey<uint32_t> BOOT_COUNT("boot_count");
+ *   prefs.put(BOOT_COUNT, prefs.get(BOOT_COUNT) + 1);
+ * T is a plain data type, bool or String.
+ * */
+template <typename T>
+struct PreferenceKey {
+    typedef T type;
+
+    const char* name;
+    size_t      length;
+
+    template <size_t N>
+    constexpr PreferenceKey(const char (&key)[N])
+        : name(key), length(N - 1)
+    {
+        static_assert(N > 1 && N <= 16, "Keys are 1 to 15 characters long");
+    }
+};
+
+class Preferences;
+
+/*
+ * Reads a value in chunks, see Preferences::openReader()
+ * */
+class PreferenceReader
+{
+    friend class Preferences;
+
+    protected:
+        Preferences* _prefs;
+        char _key[16];
+        size_t _size;
+        size_t _pos;
+    public:
+        PreferenceReader() : _prefs(NULL), _size(0), _pos(0) {}
+
+        size_t read(void* buf, size_t len);
+        size_t size() const { return _size; }
+        size_t available() const { return _size - _pos; }
+        operator bool() const { return _prefs != NULL; }
+};
+
+/*
+ * Writes a value of a known size in chunks, see Preferences::openWriter().
+ * The value is stored by close(), once all of it is written.
+ * openWriter() returns a closed writer if the backend can't hold the size:
+ * values are limited to SFUD_NVS_MAX_VALUE (1KB) on Wio Terminal and to
+ * DCT_VARIABLE_VALUE_SIZE (132 bytes) on Ameba.
+ * */
+class PreferenceWriter
+{
+    friend class Preferences;
+
+    protected:
+        Preferences* _prefs;
+        char _key[16];
+        size_t _size;
+        size_t _pos;
+        uint32_t _off;
+        uint8_t* _buf;
+
+        PreferenceWriter(const PreferenceWriter&);
+        PreferenceWriter& operator=(const PreferenceWriter&);
+    public:
+        PreferenceWriter() : _prefs(NULL), _size(0), _pos(0), _off(0), _buf(NULL) {}
+        PreferenceWriter(PreferenceWriter&& other);
+        ~PreferenceWriter();
+
+        size_t write(const void* buf, size_t len);
+        bool close();
+        size_t size() const { return _size; }
+        operator bool() const { return _prefs != NULL; }
+};
+
 class Preferences
 {
+    friend class PreferenceReader;
+    friend class PreferenceWriter;
+
     typedef float float_t;
     typedef double double_t;
 
@@ -26,9 +141,51 @@ class Preferences
         dct_handle_t _handle;
 #else
         String _path;
+#endif
+#if defined(NVS_USE_SFUD)
+        uint8_t _nsId;
 #endif
         bool _started;
         bool _readOnly;
+        bool _inTransaction;
+        uint8_t* _txnData;
+        size_t _txnSize;
+        uint8_t* _cache;
+        size_t _cacheSize;
+        size_t _cacheUsed;
+        uint32_t _cacheHits;
+        uint32_t _cacheMisses;
+#if defined(NVS_PACKED)
+        uint8_t* _table;
+        size_t _tableSize;
+        uint32_t _tableGen;
+        uint8_t _genSlot;
+#if defined(NVS_PACKED_MMAP)
+        bool _tableMapped;
+        uint64_t _mapIno;
+        uint64_t _mapTime;
+        uint64_t _mapCheck;
+#endif
+
+        void _load();
+        void _unload();
+#endif
+
+        bool _txnBegin();
+        size_t _txnPut(const char* key, const void* buf, size_t len);
+        size_t _cacheFind(const char* key);
+        const uint8_t* _cacheGet(const char* key, size_t* len);
+        void _cacheDrop(const char* key);
+        void _cachePut(const char* key, const void* buf, size_t len);
+        bool _isKey(const char* key);
+        size_t _getString(const char* key, char* value, size_t maxLen);
+        String _getString(const char* key, String defaultValue);
+        size_t _getBytesLength(const char* key);
+        size_t _getBytes(const char* key, void * buf, size_t maxLen);
+        size_t _readAt(const char* key, size_t offset, void* buf, size_t len);
+        bool _writeOpen(PreferenceWriter& w);
+        bool _writeChunk(PreferenceWriter& w, const void* buf, size_t len);
+        bool _writeClose(PreferenceWriter& w, bool store);
     public:
         Preferences();
         ~Preferences();
@@ -55,6 +212,7 @@ class Preferences
         size_t putString(const char* key, const char* value);
         size_t putString(const char* key, String value);
         size_t putBytes(const char* key, const void* buf, size_t len);
+        size_t putEntries(const PreferenceEntry* entries, size_t count);
 
         bool isKey(const char* key);
         PreferenceType getType(const char* key);
@@ -75,7 +233,54 @@ class Preferences
         String getString(const char* key, String defaultValue = String());
         size_t getBytesLength(const char* key);
         size_t getBytes(const char* key, void * buf, size_t maxLen);
+#if defined(NVS_PACKED)
+        const void* getView(const char* key, size_t* len);
+#endif
         size_t freeEntries();
+        PreferenceStats stats();
+
+        size_t forEach(PreferenceCallback callback, void* arg = NULL);
+
+        size_t exportTo(Stream& out);
+        size_t importFrom(Stream& in);
+
+        PreferenceReader openReader(const char* key);
+        PreferenceWriter openWriter(const char* key, size_t size);
+
+        template <typename T>
+        size_t put(const PreferenceKey<T>& key, const typename PreferenceKey<T>::type& value) {
+            return putBytes(key.name, &value, sizeof(T));
+        }
+        template <typename T>
+        T get(const PreferenceKey<T>& key, const typename PreferenceKey<T>::type& defaultValue = T()) {
+            T value;
+            return (getBytes(key.name, &value, sizeof(T)) == sizeof(T)) ? value : defaultValue;
+        }
+        size_t put(const PreferenceKey<bool>& key, bool value) {
+            return putBool(key.name, value);
+        }
+        bool get(const PreferenceKey<bool>& key, bool defaultValue = false) {
+            return getBool(key.name, defaultValue);
+        }
+        size_t put(const PreferenceKey<String>& key, const String& value) {
+            return putString(key.name, value);
+        }
+        String get(const PreferenceKey<String>& key, const String& defaultValue = String()) {
+            return getString(key.name, defaultValue);
+        }
+
+        bool beginTransaction();
+        bool commit();
+        void rollback();
+
+        bool setCacheSize(size_t size);
+        uint32_t cacheHits() const { return _cacheHits; }
+        uint32_t cacheMisses() const { return _cacheMisses; }
+
+        static size_t maintenance(size_t budget = 1);
+
+        static PreferenceIoStats ioStats();
+        static void resetIoStats();
 
         #ifdef NVS_FORMAT_ENABLE
         static bool format();
@@ -28,6 +28,10 @@
   #define DCT_BACKUP                  1
 #endif
 
+#if defined(NVS_STATS)
+  #include "prefs_io_stats.h"
+#endif
+
 static bool gPrefsDctInit;
 
 bool Preferences::begin(const char * name, bool readOnly){
@@ -78,12 +82,23 @@ void Preferences::end(){
     if(!_started){
         return;
     }
+    rollback();
+    _cacheUsed = 0;
     if (DCT_SUCCESS != dct_close_module(&_handle)) {
         LOG_E("Cannot close module");
     }
     _started = false;
 }
 
+/*
+ * Background maintenance: DCT reclaims space on its own
+ * */
+
+size_t Preferences::maintenance(size_t budget){
+    (void)budget;
+    return 0;
+}
+
 /*
  * Clear all keys in opened preferences
  *
@@ -95,6 +110,7 @@ bool Preferences::clear(){
     if(!_started || _readOnly){
         return false;
     }
+    _cacheUsed = 0;
 
     char name[MODULE_NAME_SIZE+1];
     memcpy(name, _handle.module_name, sizeof(name));
@@ -130,6 +146,7 @@ bool Preferences::remove(const char * key){
     if(!_started || !key || _readOnly){
         return false;
     }
+    _cacheDrop(key);
     int32_t ret = dct_delete_variable_new(&_handle, (char*)key);
     return (DCT_SUCCESS == ret);
 }
@@ -139,9 +156,13 @@ bool Preferences::remove(const char * key){
  * */
 
 size_t Preferences::putBytes(const char* key, const void* buf, size_t len){
-    if(!_started || !key || !buf || _readOnly){
+    if(!_started || !key || !*key || !buf || _readOnly){
         return 0;
     }
+    if (_inTransaction) {
+        return _txnPut(key, buf, len);
+    }
+    _cacheDrop(key);
 
     if (DCT_SUCCESS == dct_set_variable_new(&_handle, (char*)key, (char*)buf, len)) {
         return len;
@@ -150,7 +171,36 @@ size_t Preferences::putBytes(const char* key, const void* buf, size_t len){
     return 0;
 }
 
-bool Preferences::isKey(const char* key) {
+/*
+ * Put several keys at once
+ *
+ * The DCT has no multi-key update: the entries are checked first, so a
+ * batch with an invalid one stores nothing, then they're set one by one.
+ * A write error can still leave the leading ones stored.
+ * */
+
+size_t Preferences::putEntries(const PreferenceEntry* entries, size_t count){
+    if(!_started || _readOnly || !entries){
+        return 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+        const PreferenceEntry& e = entries[i];
+        if (!e.key || !*e.key || strlen(e.key) >= DCT_VARIABLE_NAME_SIZE || !e.value ||
+            e.length > DCT_VARIABLE_VALUE_SIZE) {
+            return 0;
+        }
+        _cacheDrop(e.key);
+    }
+    for (size_t i = 0; i < count; i++) {
+        const PreferenceEntry& e = entries[i];
+        if (putBytes(e.key, e.value, e.length) != e.length || (!e.length && !isKey(e.key))) {
+            return i;
+        }
+    }
+    return count;
+}
+
+bool Preferences::_isKey(const char* key) {
     if(!_started || !key){
         return false;
     }
@@ -173,7 +223,7 @@ bool Preferences::isKey(const char* key) {
  * Get a key value
  * */
 
-size_t Preferences::getString(const char* key, char* value, const size_t maxLen){
+size_t Preferences::_getString(const char* key, char* value, const size_t maxLen){
     if(!_started || !key || !value || !maxLen){
         return 0;
     }
@@ -188,7 +238,7 @@ size_t Preferences::getString(const char* key, char* value, const size_t maxLen)
     return len;
 }
 
-String Preferences::getString(const char* key, const String defaultValue){
+String Preferences::_getString(const char* key, const String defaultValue){
     if(!_started || !key){
         return defaultValue;
     }
@@ -204,7 +254,7 @@ String Preferences::getString(const char* key, const String defaultValue){
     return defaultValue;
 }
 
-size_t Preferences::getBytesLength(const char* key){
+size_t Preferences::_getBytesLength(const char* key){
     if(!_started || !key){
         return 0;
     }
@@ -219,7 +269,7 @@ size_t Preferences::getBytesLength(const char* key){
     return 0;
 }
 
-size_t Preferences::getBytes(const char* key, void * buf, size_t maxLen){
+size_t Preferences::_getBytes(const char* key, void * buf, size_t maxLen){
     if(!_started || !key){
         return 0;
     }
@@ -233,6 +283,73 @@ size_t Preferences::getBytes(const char* key, void * buf, size_t maxLen){
     return 0;
 }
 
+/*
+ * Iterate over all keys, by variable index
+ * */
+
+size_t Preferences::forEach(PreferenceCallback callback, void* arg){
+    if(!_started || !callback){
+        return 0;
+    }
+
+    size_t count = 0;
+    uint16_t num = dct_get_variable_num(&_handle);
+    for (int i=0; i<num; i++) {
+        char name[DCT_VARIABLE_NAME_SIZE+1];
+        char value[DCT_VARIABLE_VALUE_SIZE];
+        uint16_t len = sizeof(value);
+        if (DCT_SUCCESS != dct_get_variable_name(&_handle, i, (uint8_t*)name)) {
+            continue;
+        }
+        name[DCT_VARIABLE_NAME_SIZE] = '\0';
+        if (DCT_SUCCESS != dct_get_variable_new(&_handle, name, value, &len)) {
+            continue;
+        }
+        count++;
+        if (!callback(name, value, len, arg)) {
+            break;
+        }
+    }
+    return count;
+}
+
+size_t Preferences::_readAt(const char* key, size_t offset, void* buf, size_t len){
+    char value[DCT_VARIABLE_VALUE_SIZE];
+    size_t n = _getBytes(key, value, sizeof(value));
+    if (offset >= n) {
+        return 0;
+    }
+    if (len > n - offset) {
+        len = n - offset;
+    }
+    memcpy(buf, value + offset, len);
+    return len;
+}
+
+/*
+ * Storage figures: each variable of a module takes a fixed-size slot
+ * */
+
+PreferenceStats Preferences::stats(){
+    PreferenceStats st;
+    memset(&st, 0, sizeof(st));
+    if(!_started){
+        return st;
+    }
+    const size_t slot = DCT_VARIABLE_NAME_SIZE + DCT_VARIABLE_VALUE_SIZE;
+    int32_t remain = dct_remain_variable(&_handle);
+    if (remain < 0) {
+        remain = 0;
+    }
+    st.entries     = dct_get_variable_num(&_handle);
+    st.bytesUsed   = st.entries * slot;
+    st.bytesFree   = remain * slot;
+    st.blockSize   = slot;
+    st.blocksUsed  = st.entries;
+    st.blocksTotal = st.entries + remain;
+    return st;
+}
+
 size_t Preferences::freeEntries() {
     if(!_started){
         return 0;
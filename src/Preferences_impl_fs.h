@@ -11,6 +11,8 @@
 
 #define NVS_STAGING_FN  "\a_new?"
 #define NVS_DELETED_FN  "\a_del?"
+#define NVS_COMMIT_FN   "\a_commit?"
+#define NVS_STREAM_FN   "\a_str?"     // staging file of a PreferenceWriter
 
 #if defined(NVS_USE_POSIX)
   #include "prefs_impl_posix.h"
@@ -22,12 +24,93 @@
   #include "prefs_impl_dummy.h"
 #endif
 
+#if defined(NVS_STATS)
+  #include "prefs_io_stats.h"
+#endif
+
+/*
+ * A namespace is limited by the filesystem only. Keys are limited to 15
+ * characters whatever the prefix in front of them, so a key that putBytes()
+ * takes works in putEntries() and in a writer too. SPIFFS limits the whole path.
+ * */
+
+#define NVS_KEY_MAX     15
+
+#if defined(_FS_PATH_MAX)
+  #define NVS_NAME_MAX  (_FS_PATH_MAX - sizeof(NVS_PATH) - 2)  // leaves "/" and a 1-character key
+  #define NVS_PATH_SIZE (_FS_PATH_MAX + 1)
+#else
+  #define NVS_NAME_MAX  _FS_NAME_MAX
+  // Fits NVS_PATH/{namespace}/{prefix}{key}, NVS_STAGING_FN being the longest prefix
+  #define NVS_PATH_SIZE (sizeof(NVS_PATH) + 1 + NVS_NAME_MAX + 1 + sizeof(NVS_STAGING_FN) - 1 + NVS_KEY_MAX)
+#endif
+
+static_assert(sizeof(NVS_STREAM_FN) <= sizeof(NVS_STAGING_FN), "NVS_PATH_SIZE is sized for NVS_STAGING_FN");
+
 static bool gPrefsFsInit;
 
+/*
+ * Build the path of a key into a buffer of NVS_PATH_SIZE bytes, so the
+ * get/put paths don't allocate. Returns false if it doesn't fit.
+ * */
+
+static bool _fs_path(char* path, const String& dir, const char* prefix, const char* key){
+    size_t d = dir.length(), p = strlen(prefix), k = strlen(key);
+    if (k > NVS_KEY_MAX || d + p + k >= NVS_PATH_SIZE) {
+        LOG_E("key is too long: %s", key);
+        return false;
+    }
+    memcpy(path, dir.c_str(), d);
+    memcpy(path + d, prefix, p);
+    memcpy(path + d + p, key, k + 1);
+    return true;
+}
+
+#if !defined(NVS_USE_SPIFFS)
+
+/*
+ * Move the staged values of a committed batch into place (see putEntries()).
+ * The commit file lists their keys, each one followed by '/'.
+ * */
+
+static bool _fs_apply_batch(const String& dir){
+    String commit = dir + NVS_COMMIT_FN;
+    int size = _fs_get_size(commit.c_str());
+    if (size < 0) {
+        return true; // nothing to do
+    }
+    char* list = (char*)malloc(size + 1);
+    if (!list) {
+        return false;
+    }
+    bool ok = (_fs_read(commit.c_str(), list, size) == size);
+    list[ok ? size : 0] = '\0';
+    for (char* key = list; ok && *key; ) {
+        char* end = strchr(key, '/');
+        if (!end) {
+            break;
+        }
+        *end = '\0';
+        String next = dir + NVS_STAGING_FN + key;
+        if (_fs_exists(next.c_str())) {
+            ok = _fs_rename(next.c_str(), (dir + key).c_str());
+        }
+        key = end + 1;
+    }
+    free(list);
+    return ok && _fs_unlink(commit.c_str());
+}
+
+#endif
+
 bool Preferences::begin(const char * name, bool readOnly){
     if(_started || !name || !strlen(name)){
         return false;
     }
+    if (strlen(name) > NVS_NAME_MAX) {
+        LOG_E("namespace is too long: %s", name);
+        return false;
+    }
     _readOnly = readOnly;
 
     if (!gPrefsFsInit) {
@@ -54,6 +137,12 @@ bool Preferences::begin(const char * name, bool readOnly){
     if (_fs_mkdir(p.c_str())) {
         _started = true;
         _path = String(NVS_PATH) + String("/") + name + String("/");
+#if !defined(NVS_USE_SPIFFS)
+        // Finish a batch that was interrupted after its commit
+        if (!_fs_apply_batch(_path)) {
+            LOG_E("Cannot apply a committed batch");
+        }
+#endif
     }
 
     return _started;
@@ -63,6 +152,8 @@ void Preferences::end(){
     if(!_started){
         return;
     }
+    rollback();
+    _cacheUsed = 0;
     _path = "";
     _started = false;
 }
@@ -89,6 +180,15 @@ bool Preferences::format(){
 
 #endif
 
+/*
+ * Background maintenance: the filesystem reclaims space on its own
+ * */
+
+size_t Preferences::maintenance(size_t budget){
+    (void)budget;
+    return 0;
+}
+
 /*
  * Clear all keys in opened preferences
  * */
@@ -97,16 +197,20 @@ bool Preferences::clear(){
     if(!_started || _readOnly){
         return false;
     }
+    _cacheUsed = 0;
 
 #if defined(NVS_ATOMIC_CLEAR)
     String path = _path.substring(0, _path.length()-1);
     String deleted = String(NVS_PATH) + String("/" NVS_DELETED_FN);
+    bool ok;
     if (_fs_rename(path.c_str(), deleted.c_str())) {
-        return _fs_clean_dir((deleted + "/").c_str());
+        ok = _fs_clean_dir((deleted + "/").c_str());
     } else {
         LOG_W("Cannot rename directory");
-        return _fs_clean_dir(path.c_str());
+        ok = _fs_clean_dir(_path.c_str());
     }
+    // Where directories aren't created as needed, put*() needs it back
+    return _fs_mkdir(path.c_str()) && ok;
 #else
     if (_fs_clean_dir(_path.c_str())) {
         String p = _path.substring(0, _path.length()-1);
@@ -124,8 +228,9 @@ bool Preferences::remove(const char * key){
     if(!_started || !key || _readOnly){
         return false;
     }
-    String path = _path + key;
-    return _fs_unlink(path.c_str());
+    _cacheDrop(key);
+    char path[NVS_PATH_SIZE];
+    return _fs_path(path, _path, "", key) && _fs_unlink(path);
 }
 
 /*
@@ -136,56 +241,153 @@ size_t Preferences::putBytes(const char* key, const void* buf, size_t len){
     if(!_started || !key || !buf || _readOnly){
         return 0;
     }
+    if (_inTransaction) {
+        return _txnPut(key, buf, len);
+    }
+    _cacheDrop(key);
 
-    String path = _path + key;
+    char path[NVS_PATH_SIZE];
+    if (!_fs_path(path, _path, "", key)) {
+        return 0;
+    }
 
-    if (_fs_exists(path.c_str())) {
 #if defined(NVS_USE_SPIFFS)
-        int written = _fs_update(path.c_str(), buf, len);
-        return (written < 0) ? 0 : (size_t)written;
+    int written = _fs_exists(path) ? _fs_update(path, buf, len) : _fs_create(path, buf, len);
+    return (written < 0) ? 0 : (size_t)written;
 #else
-        if (_fs_verify(path.c_str(), buf, len)) {
-            LOG_I("data matches, skip writing to %s", path.c_str());
-            return len;
-        }
+    if (_fs_verify(path, buf, len)) {
+        LOG_I("data matches, skip writing to %s", path);
+        return len;
+    }
+
+    // New keys too are staged, then renamed into place: a power loss while
+    // writing leaves either the old value or no key, never a partial one
+    char next[NVS_PATH_SIZE];
+    int written = _fs_path(next, _path, "", NVS_STAGING_FN) ? _fs_create(next, buf, len) : -1;
 
-        String next = _path + NVS_STAGING_FN;
+    if (written == (int)len && _fs_rename(next, path)) {
+        return written;
+    } else {
+        return 0;
+    }
+#endif
+}
 
-        int written = _fs_create(next.c_str(), buf, len);
+/*
+ * Put several keys at once
+ *
+ * All or nothing: the changed values are staged next to the old ones, then
+ * a commit file listing them is renamed into place. Once it exists, the batch
+ * is applied, even if that's only at the next begin() after a power loss.
+ *
+ * SPIFFS has no rename: the entries are checked first, so a batch with an
+ * invalid one stores nothing, then they're written one by one.
+ * */
 
-        if (written >= 0 && _fs_rename(next.c_str(), path.c_str())) {
-            return written;
-        } else {
+size_t Preferences::putEntries(const PreferenceEntry* entries, size_t count){
+    if(!_started || _readOnly || !entries){
+        return 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+        _cacheDrop(entries[i].key);
+    }
+#if defined(NVS_USE_SPIFFS)
+    for (size_t i = 0; i < count; i++) {
+        char path[NVS_PATH_SIZE];
+        if (!entries[i].key || !*entries[i].key || !entries[i].value ||
+            !_fs_path(path, _path, "", entries[i].key)) {
             return 0;
         }
-#endif
-    } else {
-        int written = _fs_create(path.c_str(), buf, len);
-        return (written < 0) ? 0 : (size_t)written;
     }
+    for (size_t i = 0; i < count; i++) {
+        const PreferenceEntry& e = entries[i];
+        if (putBytes(e.key, e.value, e.length) != e.length || (!e.length && !isKey(e.key))) {
+            return i;
+        }
+    }
+    return count;
+#else
+    String list;
+    size_t i;
+    bool ok = true;
+    for (i = 0; i < count; i++) {
+        const PreferenceEntry& e = entries[i];
+        if (!e.key || !*e.key || strchr(e.key, '/') || !e.value) {
+            ok = false;
+            break;
+        }
+        char path[NVS_PATH_SIZE], next[NVS_PATH_SIZE];
+        if (!_fs_path(path, _path, "", e.key) || !_fs_path(next, _path, NVS_STAGING_FN, e.key)) {
+            ok = false;
+            break;
+        }
+        String item = String(e.key) + "/";
+        bool listed = (strstr(("/" + list).c_str(), ("/" + item).c_str()) != NULL);
+        if (!listed && _fs_verify(path, e.value, e.length)) {
+            continue; // unchanged
+        }
+        if (_fs_create(next, e.value, e.length) != (int)e.length) {
+            ok = false;
+            break;
+        }
+        if (!listed) {
+            list = list + item;
+        }
+    }
+
+    if (ok && list.length()) {
+        String next   = _path + NVS_STAGING_FN;
+        String commit = _path + NVS_COMMIT_FN;
+        if (_fs_create(next.c_str(), list.c_str(), list.length()) != (int)list.length() ||
+            !_fs_rename(next.c_str(), commit.c_str())) {
+            ok = false;
+        } else if (!_fs_apply_batch(_path)) {
+            // The batch is committed, the next begin() applies the rest.
+            // Until then, only the leading entries already in place are stored.
+            LOG_E("Cannot apply a committed batch");
+            for (i = 0; i < count; i++) {
+                char next[NVS_PATH_SIZE];
+                if (!_fs_path(next, _path, NVS_STAGING_FN, entries[i].key) || _fs_exists(next)) {
+                    break;
+                }
+            }
+            return i;
+        }
+    }
+
+    if (!ok) {
+        // Drop the staged values, including one that may be partially written
+        for (size_t j = 0; j <= i && j < count; j++) {
+            char next[NVS_PATH_SIZE];
+            if (entries[j].key && _fs_path(next, _path, NVS_STAGING_FN, entries[j].key)) {
+                _fs_unlink(next);
+            }
+        }
+        return 0;
+    }
+    return count;
+#endif
 }
 
-bool Preferences::isKey(const char* key) {
+bool Preferences::_isKey(const char* key) {
     if(!_started || !key){
         return false;
     }
-    String path = _path + key;
-
-    return _fs_exists(path.c_str());
+    char path[NVS_PATH_SIZE];
+    return _fs_path(path, _path, "", key) && _fs_exists(path);
 }
 
 /*
  * Get a key value
  * */
 
-size_t Preferences::getString(const char* key, char* value, const size_t maxLen){
+size_t Preferences::_getString(const char* key, char* value, const size_t maxLen){
     if(!_started || !key || !value || !maxLen){
         return 0;
     }
 
-    String path = _path + key;
-
-    int len = _fs_get_size(path.c_str());
+    char path[NVS_PATH_SIZE];
+    int len = _fs_path(path, _path, "", key) ? _fs_read_all(path, value, maxLen - 1) : -1;
     if (len < 0) {
         // Not found: match the ESP32 API and leave the buffer untouched.
         return 0;
@@ -194,50 +396,60 @@ size_t Preferences::getString(const char* key, char* value, const size_t maxLen)
         // Doesn't fit: match the ESP32 API and leave the buffer untouched.
         return 0;
     }
-    if (len > 0 && _fs_read(path.c_str(), value, len) != len) {
-        return 0;
-    }
     value[len] = '\0';
     return (size_t)len;
 }
 
-String Preferences::getString(const char* key, const String defaultValue){
+String Preferences::_getString(const char* key, const String defaultValue){
     if(!_started || !key){
         return defaultValue;
     }
 
-    String path = _path + key;
-
-    int len = _fs_get_size(path.c_str());
+    char path[NVS_PATH_SIZE];
+    if (!_fs_path(path, _path, "", key)) {
+        return defaultValue;
+    }
 
-    // TODO: allocate on heap, remove this limitation
-    if (len >= 0 && len <= 1024) {
-        char buff[len+1];
-        getBytes(key, buff, len);
+    // Short strings are read in one go, longer ones on the heap
+    char buff[64];
+    int len = _fs_read_all(path, buff, sizeof(buff) - 1);
+    if (len < 0) {
+        return defaultValue;
+    }
+    if ((size_t)len < sizeof(buff)) {
         buff[len] = '\0';
         return String(buff);
     }
-    return defaultValue;
+
+    char* heap = (char*)malloc(len + 1);
+    if (!heap) {
+        return defaultValue;
+    }
+    String result = defaultValue;
+    if (_fs_read_all(path, heap, len) == len) {
+        heap[len] = '\0';
+        result = String(heap);
+    }
+    free(heap);
+    return result;
 }
 
-size_t Preferences::getBytesLength(const char* key){
+size_t Preferences::_getBytesLength(const char* key){
     if(!_started || !key){
         return 0;
     }
 
-    String path = _path + key;
-
-    int len = _fs_get_size(path.c_str());
+    char path[NVS_PATH_SIZE];
+    int len = _fs_path(path, _path, "", key) ? _fs_get_size(path) : -1;
     return (len >= 0) ? len : 0;
 }
 
-size_t Preferences::getBytes(const char* key, void * buf, size_t maxLen){
+size_t Preferences::_getBytes(const char* key, void * buf, size_t maxLen){
     if(!_started || !key){
         return 0;
     }
-    String path = _path + key;
-
-    int len = _fs_get_size(path.c_str());
+    char path[NVS_PATH_SIZE];
+    int len = _fs_path(path, _path, "", key) ? _fs_read_all(path, buf, buf ? maxLen : 0) : -1;
     if(len < 0){
         LOG_I("value not found: %s", key);
         return 0;
@@ -249,10 +461,167 @@ size_t Preferences::getBytes(const char* key, void * buf, size_t maxLen){
         LOG_W("not enough space in buffer: %u < %u", maxLen, len);
         return 0;
     }
+    return len;
+}
 
-    return _fs_read(path.c_str(), buf, len);
+/*
+ * Iterate over all keys: one directory listing, each value read with a
+ * single open(). Staging and commit files start with '\a' and are skipped.
+ * */
+
+struct _FsForEach {
+    const String* dir;
+    PreferenceCallback callback;
+    void* arg;
+    size_t count;
+};
+
+static bool _fs_for_each_file(const char* name, void* arg){
+    _FsForEach* ctx = (_FsForEach*)arg;
+    char path[NVS_PATH_SIZE];
+    if (name[0] == '\a' || !_fs_path(path, *ctx->dir, "", name)) {
+        return true;
+    }
+
+    // Short values are read in one go, longer ones on the heap
+    uint8_t buff[64];
+    int len = _fs_read_all(path, buff, sizeof(buff));
+    if (len < 0) {
+        return true;
+    }
+    bool more;
+    if ((size_t)len <= sizeof(buff)) {
+        more = ctx->callback(name, buff, len, ctx->arg);
+    } else {
+        uint8_t* heap = (uint8_t*)malloc(len);
+        if (!heap || _fs_read_all(path, heap, len) != len) {
+            free(heap);
+            return true;
+        }
+        more = ctx->callback(name, heap, len, ctx->arg);
+        free(heap);
+    }
+    ctx->count++;
+    return more;
+}
+
+size_t Preferences::forEach(PreferenceCallback callback, void* arg){
+    if(!_started || !callback){
+        return 0;
+    }
+    _FsForEach ctx = { &_path, callback, arg, 0 };
+    _fs_list_dir(_path.c_str(), _fs_for_each_file, &ctx);
+    return ctx.count;
 }
 
+/*
+ * Streams: a writer fills a staging file, which replaces the value on close().
+ * It has its own prefix, so putEntries() can't take or remove it meanwhile.
+ * SPIFFS has no rename, so there the value is written in place.
+ * */
+
+static bool _fs_stream_path(char* path, const String& dir, const char* key){
+#if defined(NVS_USE_SPIFFS)
+    return _fs_path(path, dir, "", key);
+#else
+    return _fs_path(path, dir, NVS_STREAM_FN, key);
+#endif
+}
+
+size_t Preferences::_readAt(const char* key, size_t offset, void* buf, size_t len){
+    char path[NVS_PATH_SIZE];
+    int n = _fs_path(path, _path, "", key) ? _fs_read_at(path, offset, buf, len) : -1;
+    return (n > 0) ? n : 0;
+}
+
+bool Preferences::_writeOpen(PreferenceWriter& w){
+    char next[NVS_PATH_SIZE];
+    return _fs_stream_path(next, _path, w._key) && _fs_create(next, "", 0) == 0;
+}
+
+bool Preferences::_writeChunk(PreferenceWriter& w, const void* buf, size_t len){
+    char next[NVS_PATH_SIZE];
+    return _fs_stream_path(next, _path, w._key) && _fs_append(next, buf, len) == (int)len;
+}
+
+bool Preferences::_writeClose(PreferenceWriter& w, bool store){
+    char path[NVS_PATH_SIZE], next[NVS_PATH_SIZE];
+    if (!_fs_path(path, _path, "", w._key) || !_fs_stream_path(next, _path, w._key)) {
+        return false;
+    }
+#if defined(NVS_USE_SPIFFS)
+    if (!store) {
+        _fs_unlink(path);
+    }
+    return store;
+#else
+    if (store && _fs_rename(next, path)) {
+        return true;
+    }
+    _fs_unlink(next);
+    return false;
+#endif
+}
+
+/*
+ * Storage figures: the keys are counted by listing the namespace directory,
+ * usage comes from the filesystem. Leftover staging files count as dead.
+ * */
+
+struct _FsStats {
+    const String*    dir;
+    PreferenceStats* st;
+};
+
+static bool _fs_stats_file(const char* name, void* arg){
+    _FsStats* ctx = (_FsStats*)arg;
+    // Not _fs_path(): a staged name is longer than a key
+    String path = *ctx->dir + name;
+    int len = _fs_get_size(path.c_str());
+    if (len < 0) {
+        return true;
+    }
+    if (name[0] == '\a') {
+        ctx->st->deadEntries++;
+        ctx->st->deadBytes += len;
+    } else {
+        ctx->st->entries++;
+        ctx->st->bytesUsed += len;
+    }
+    return true;
+}
+
+PreferenceStats Preferences::stats(){
+    PreferenceStats st;
+    memset(&st, 0, sizeof(st));
+    if(!_started){
+        return st;
+    }
+    _FsStats ctx = { &_path, &st };
+    _fs_list_dir(_path.c_str(), _fs_stats_file, &ctx);
+
+    size_t total, used;
+    if (_fs_info(_path.c_str(), &st.blockSize, &total, &used)) {
+        st.bytesFree = total - used;
+        if (st.blockSize) {
+            st.blocksTotal = total / st.blockSize;
+            st.blocksUsed  = used / st.blockSize;
+        }
+    }
+    if (st.deadBytes) {
+        st.fragmentation = st.deadBytes * 100 / (st.bytesUsed + st.deadBytes);
+    }
+    return st;
+}
+
+// Each key takes a file, so at least one block
 size_t Preferences::freeEntries() {
-    return 1000;
+    if(!_started){
+        return 0;
+    }
+    size_t blockSize, total, used;
+    if (!_fs_info(_path.c_str(), &blockSize, &total, &used)) {
+        return 1000; // unknown
+    }
+    return (total - used) / (blockSize ? blockSize : 32); // else the size of an ESP32 NVS entry
 }
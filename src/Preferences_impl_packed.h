@@ -0,0 +1,622 @@
+/*
+ * Packed namespaces: each namespace is a single file, NVS_PATH/{namespace}.kv,
+ * holding all of its keys:
+ *   [magic:4]([key_len:1][val_len:2][key:key_len][val:val_len])...
+ *
+ * The file is loaded into RAM by begin(), so reads don't touch the filesystem.
+ * Every change rewrites the whole file through NVS_STAGING_FN and a rename,
+ * so it's atomic (except on SPIFFS, which has no rename).
+ *
+ * On Linux, read-only objects mmap() the file instead (see NVS_PACKED_MMAP),
+ * and getView() returns values without copying them.
+ */
+
+#if defined(NVS_PATH)
+  // OK, use it.
+#else
+  #define NVS_PATH "/nvs"
+#endif
+
+#define NVS_STAGING_FN  "\a_new?"
+#define NVS_PACKED_EXT  ".kv"
+
+#if defined(NVS_USE_POSIX)
+  #include "prefs_impl_posix.h"
+#elif defined(NVS_USE_LITTLEFS)
+  #include "prefs_impl_arduino.h"
+#elif defined(NVS_USE_SPIFFS)
+  #include "prefs_impl_spiffs.h"
+#elif defined(NVS_USE_DUMMY)
+  #include "prefs_impl_dummy.h"
+#endif
+
+#if defined(NVS_STATS)
+  #include "prefs_io_stats.h"
+#endif
+
+#if defined(NVS_PACKED_MMAP)
+  #include <sys/mman.h>
+  #include <time.h>
+#endif
+
+// Longest namespace: its file name is limited by the filesystem (SPIFFS limits the whole path)
+#if defined(_FS_PATH_MAX)
+  #define NVS_NAME_MAX  (_FS_PATH_MAX - sizeof(NVS_PATH) - (sizeof(NVS_PACKED_EXT) - 1))
+#else
+  #define NVS_NAME_MAX  (_FS_NAME_MAX - (sizeof(NVS_PACKED_EXT) - 1))
+#endif
+
+static const uint32_t NVS_PACKED_MAGIC = 0x314B564E; // "NVK1"
+
+#ifndef NVS_PACKED_GEN_SLOTS
+  #define NVS_PACKED_GEN_SLOTS 16
+#endif
+
+static bool     gPrefsFsInit;
+
+/*
+ * Write counters: a write bumps the counter of its namespace, so only the other
+ * objects open on it reload their table. Namespaces are spread over the slots
+ * by a hash of their path; the ones that share a slot just reload more often.
+ * */
+static uint32_t gPrefsPackedGen[NVS_PACKED_GEN_SLOTS];
+
+static uint8_t _pk_gen_slot(const String& path) {
+    uint32_t h = 2166136261u; // FNV-1a
+    for (const char* p = path.c_str(); *p; p++) {
+        h = (h ^ (uint8_t)*p) * 16777619u;
+    }
+    return (uint8_t)(h % NVS_PACKED_GEN_SLOTS);
+}
+
+static size_t _pk_entry_size(const uint8_t* p) {
+    return 3 + p[0] + (p[1] | (p[2] << 8));
+}
+
+// Returns the entry for `key`, or NULL if there's none
+static uint8_t* _pk_find(uint8_t* data, size_t size, const char* key) {
+    size_t klen = strlen(key);
+    for (size_t off = sizeof(NVS_PACKED_MAGIC); off < size; off += _pk_entry_size(data + off)) {
+        if (data[off] == klen && !memcmp(data + off + 3, key, klen)) {
+            return data + off;
+        }
+    }
+    return NULL;
+}
+
+static const uint8_t* _pk_value(const uint8_t* e, size_t* len) {
+    *len = e[1] | (e[2] << 8);
+    return e + 3 + e[0];
+}
+
+// Sets `key` in a table allocated with malloc(), which may be moved
+static bool _pk_set(uint8_t** data, size_t* size, const char* key, const void* buf, size_t len) {
+    size_t   klen = strlen(key);
+    uint8_t* e    = _pk_find(*data, *size, key);
+    if (e) {
+        size_t n = _pk_entry_size(e);
+        memmove(e, e + n, *size - (e - *data) - n);
+        *size -= n;
+    }
+    uint8_t* p = (uint8_t*)realloc(*data, *size + 3 + klen + len);
+    if (!p) {
+        return false;
+    }
+    e = p + *size;
+    e[0] = (uint8_t)klen;
+    e[1] = (uint8_t)len;
+    e[2] = (uint8_t)(len >> 8);
+    memcpy(e + 3, key, klen);
+    if (len) {
+        memcpy(e + 3 + klen, buf, len);
+    }
+    *data = p;
+    *size += 3 + klen + len;
+    return true;
+}
+
+static bool _pk_save(const String& path, const uint8_t* data, size_t size) {
+#if defined(NVS_USE_SPIFFS)
+    return _fs_create(path.c_str(), data, size) == (int)size;
+#else
+    const char* next = NVS_PATH "/" NVS_STAGING_FN;
+    return _fs_create(next, data, size) == (int)size &&
+           _fs_rename(next, path.c_str());
+#endif
+}
+
+static bool _pk_valid(const uint8_t* data, size_t size) {
+    uint32_t magic = 0;
+    if (size < sizeof(magic)) {
+        return false;
+    }
+    memcpy(&magic, data, sizeof(magic));
+    size_t off = sizeof(magic);
+    bool ok = (magic == NVS_PACKED_MAGIC);
+    while (ok && off < size) {
+        ok = (off + 3 <= size) && (off + _pk_entry_size(data + off) <= size);
+        off += ok ? _pk_entry_size(data + off) : 0;
+    }
+    return ok;
+}
+
+void Preferences::_unload(){
+#if defined(NVS_PACKED_MMAP)
+    if (_tableMapped) {
+        munmap(_table, _tableSize);
+        _table = NULL;
+    }
+    _tableMapped = false;
+#endif
+    free(_table);
+    _table = NULL;
+    _tableSize = 0;
+}
+
+#if defined(NVS_PACKED_MMAP)
+
+/*
+ * Read-only objects map the namespace file instead of loading it. After a
+ * write to the namespace (its generation changes), they check that the file
+ * was replaced (its inode or mtime changes) before mapping it again. Other
+ * processes don't bump the generation, so the file is also checked when
+ * NVS_PACKED_MMAP_RECHECK_MS went by since the last check.
+ * */
+
+static uint64_t _pk_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + ts.tv_nsec / 1000000;
+}
+
+static uint64_t _pk_mtime(const struct stat& st) {
+    return (uint64_t)st.st_mtim.tv_sec * 1000000000u + st.st_mtim.tv_nsec;
+}
+
+static bool _pk_map_valid(const struct stat& st, bool mapped, uint64_t ino, uint64_t mtime, size_t size) {
+    return mapped && st.st_ino == ino && _pk_mtime(st) == mtime && (size_t)st.st_size == size;
+}
+
+#endif
+
+/*
+ * (Re)load the table of the namespace, if another object wrote to it
+ * */
+
+void Preferences::_load(){
+#if defined(NVS_PACKED_MMAP)
+    if (_readOnly) {
+        uint32_t gen = gPrefsPackedGen[_genSlot];
+        uint64_t now = _pk_now_ms();
+        if (_table && _tableGen == gen && now - _mapCheck < NVS_PACKED_MMAP_RECHECK_MS) {
+            return;
+        }
+        struct stat st;
+        bool found = (0 == stat(_path.c_str(), &st));
+        _tableGen = gen;
+        _mapCheck = now;
+        if (_table && (found ? _pk_map_valid(st, _tableMapped, _mapIno, _mapTime, _tableSize) : !_tableMapped)) {
+            return;
+        }
+        _unload();
+        int fd = found ? open(_path.c_str(), O_RDONLY) : -1;
+        if (fd >= 0) {
+            if (0 == fstat(fd, &st) && st.st_size > 0) {
+                void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+                if (p == MAP_FAILED) {
+                    LOG_E("cannot map %s", _path.c_str());
+                } else if (!_pk_valid((const uint8_t*)p, st.st_size)) {
+                    LOG_E("corrupt namespace %s", _path.c_str());
+                    munmap(p, st.st_size);
+                } else {
+                    _table = (uint8_t*)p;
+                    _tableSize = st.st_size;
+                    _tableMapped = true;
+                    _mapIno = st.st_ino;
+                    _mapTime = _pk_mtime(st);
+                }
+            }
+            close(fd);
+        }
+        if (_table) {
+            return;
+        }
+    }
+#endif
+    if (_table && _tableGen == gPrefsPackedGen[_genSlot]) {
+        return;
+    }
+    _unload();
+
+    int len = _fs_get_size(_path.c_str());
+    if (len >= (int)sizeof(NVS_PACKED_MAGIC) && (_table = (uint8_t*)malloc(len))) {
+        _tableSize = len;
+        if (_fs_read(_path.c_str(), _table, len) != len || !_pk_valid(_table, len)) {
+            LOG_E("corrupt namespace %s", _path.c_str());
+            _unload();
+        }
+    }
+    if (!_table) {
+        _table = (uint8_t*)malloc(sizeof(NVS_PACKED_MAGIC));
+        _tableSize = _table ? sizeof(NVS_PACKED_MAGIC) : 0;
+        if (_table) {
+            memcpy(_table, &NVS_PACKED_MAGIC, sizeof(NVS_PACKED_MAGIC));
+        }
+    }
+    _tableGen = gPrefsPackedGen[_genSlot];
+}
+
+bool Preferences::begin(const char * name, bool readOnly){
+    if(_started || !name || !strlen(name)){
+        return false;
+    }
+    if (strlen(name) > NVS_NAME_MAX) {
+        LOG_E("namespace is too long: %s", name);
+        return false;
+    }
+    _readOnly = readOnly;
+
+    if (!gPrefsFsInit) {
+        if (!_fs_init()) {
+            LOG_E("FS not initialized");
+            return false;
+        }
+        if (!_fs_mkdir(NVS_PATH)) {
+            LOG_E("Cannot create NVS_PATH");
+            return false;
+        }
+        gPrefsFsInit = true;
+    }
+
+    _path = String(NVS_PATH) + String("/") + name + String(NVS_PACKED_EXT);
+    _genSlot = _pk_gen_slot(_path);
+    _load();
+    _started = (_table != NULL);
+    return _started;
+}
+
+void Preferences::end(){
+    if(!_started){
+        return;
+    }
+    rollback();
+    _cacheUsed = 0;
+    _unload();
+    _path = "";
+    _started = false;
+}
+
+/*
+ * Wipe the whole underlying filesystem, including all namespaces
+ * */
+
+#ifdef NVS_FORMAT_ENABLE
+
+bool Preferences::format(){
+    if (!_fs_init()) {
+        LOG_E("FS not initialized");
+        return false;
+    }
+    if (!_fs_format()) {
+        return false;
+    }
+    gPrefsFsInit = false;
+    for (size_t i = 0; i < NVS_PACKED_GEN_SLOTS; i++) {
+        gPrefsPackedGen[i]++;
+    }
+    return true;
+}
+
+#endif
+
+/*
+ * Background maintenance: the filesystem reclaims space on its own
+ * */
+
+size_t Preferences::maintenance(size_t budget){
+    (void)budget;
+    return 0;
+}
+
+/*
+ * Clear all keys in opened preferences
+ * */
+
+bool Preferences::clear(){
+    if(!_started || _readOnly){
+        return false;
+    }
+    _cacheUsed = 0;
+    if (_fs_exists(_path.c_str()) && !_fs_unlink(_path.c_str())) {
+        return false;
+    }
+    gPrefsPackedGen[_genSlot]++;
+    _load();
+    return true;
+}
+
+/*
+ * Remove a key
+ * */
+
+bool Preferences::remove(const char * key){
+    if(!_started || !key || _readOnly){
+        return false;
+    }
+    _cacheDrop(key);
+    _load();
+    uint8_t* e = _pk_find(_table, _tableSize, key);
+    if (!e) {
+        return false;
+    }
+    size_t n   = _pk_entry_size(e);
+    size_t off = e - _table;
+    uint8_t* data = (uint8_t*)malloc(_tableSize - n);
+    if (!data) {
+        return false;
+    }
+    memcpy(data, _table, off);
+    memcpy(data + off, _table + off + n, _tableSize - off - n);
+    bool ok = _pk_save(_path, data, _tableSize - n);
+    if (ok) {
+        free(_table);
+        _table = data;
+        _tableSize -= n;
+        _tableGen = ++gPrefsPackedGen[_genSlot];
+    } else {
+        free(data);
+    }
+    return ok;
+}
+
+/*
+ * Put a key value
+ * */
+
+size_t Preferences::putBytes(const char* key, const void* buf, size_t len){
+    if(!_started || !key || !buf || _readOnly){
+        return 0;
+    }
+    if (_inTransaction) {
+        return _txnPut(key, buf, len);
+    }
+    PreferenceEntry entry = { key, buf, len };
+    return (putEntries(&entry, 1) == 1) ? len : 0;
+}
+
+/*
+ * Put several keys at once: all or nothing, with a single rewrite
+ * */
+
+size_t Preferences::putEntries(const PreferenceEntry* entries, size_t count){
+    if(!_started || _readOnly || !entries){
+        return 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+        _cacheDrop(entries[i].key);
+    }
+    _load();
+    uint8_t* data = (uint8_t*)malloc(_tableSize);
+    size_t   size = _tableSize;
+    if (!data) {
+        return 0;
+    }
+    memcpy(data, _table, size);
+    for (size_t i = 0; i < count; i++) {
+        const PreferenceEntry& e = entries[i];
+        if (!e.key || !*e.key || strlen(e.key) > 0xFF || !e.value || e.length > 0xFFFF ||
+            !_pk_set(&data, &size, e.key, e.value, e.length)) {
+            free(data);
+            return 0;
+        }
+    }
+    if (size == _tableSize && !memcmp(data, _table, size)) {
+        LOG_I("data matches, skip writing to %s", _path.c_str());
+        free(data);
+        return count;
+    }
+    if (!_pk_save(_path, data, size)) {
+        free(data);
+        return 0;
+    }
+    free(_table);
+    _table = data;
+    _tableSize = size;
+    _tableGen = ++gPrefsPackedGen[_genSlot];
+    return count;
+}
+
+bool Preferences::_isKey(const char* key) {
+    if(!_started || !key){
+        return false;
+    }
+    _load();
+    return _pk_find(_table, _tableSize, key) != NULL;
+}
+
+/*
+ * Get a key value
+ * */
+
+size_t Preferences::_getString(const char* key, char* value, const size_t maxLen){
+    if(!_started || !key || !value || !maxLen){
+        return 0;
+    }
+    _load();
+    const uint8_t* e = _pk_find(_table, _tableSize, key);
+    if (!e) {
+        // Not found: match the ESP32 API and leave the buffer untouched.
+        return 0;
+    }
+    size_t len;
+    const uint8_t* v = _pk_value(e, &len);
+    if (len > maxLen - 1) {
+        // Doesn't fit: match the ESP32 API and leave the buffer untouched.
+        return 0;
+    }
+    memcpy(value, v, len);
+    value[len] = '\0';
+    return len;
+}
+
+String Preferences::_getString(const char* key, const String defaultValue){
+    if(!_started || !key){
+        return defaultValue;
+    }
+    _load();
+    const uint8_t* e = _pk_find(_table, _tableSize, key);
+    if (!e) {
+        return defaultValue;
+    }
+    size_t len;
+    const uint8_t* v = _pk_value(e, &len);
+    char* buff = (char*)malloc(len + 1);
+    if (!buff) {
+        return defaultValue;
+    }
+    memcpy(buff, v, len);
+    buff[len] = '\0';
+    String result(buff);
+    free(buff);
+    return result;
+}
+
+size_t Preferences::_getBytesLength(const char* key){
+    if(!_started || !key){
+        return 0;
+    }
+    _load();
+    const uint8_t* e = _pk_find(_table, _tableSize, key);
+    size_t len = 0;
+    if (e) {
+        _pk_value(e, &len);
+    }
+    return len;
+}
+
+size_t Preferences::_getBytes(const char* key, void * buf, size_t maxLen){
+    if(!_started || !key){
+        return 0;
+    }
+    _load();
+    const uint8_t* e = _pk_find(_table, _tableSize, key);
+    if(!e){
+        LOG_I("value not found: %s", key);
+        return 0;
+    }
+    size_t len;
+    const uint8_t* v = _pk_value(e, &len);
+    if(!len || !buf || !maxLen){
+        return len;
+    }
+    if(len > maxLen){
+        LOG_W("not enough space in buffer: %u < %u", maxLen, len);
+        return 0;
+    }
+    memcpy(buf, v, len);
+    return len;
+}
+
+/*
+ * Iterate over all keys: a walk of the table, values aren't copied
+ * */
+
+size_t Preferences::forEach(PreferenceCallback callback, void* arg){
+    if(!_started || !callback){
+        return 0;
+    }
+    _load();
+    const uint8_t* data = _table;
+    size_t count = 0;
+    for (size_t off = sizeof(NVS_PACKED_MAGIC); off < _tableSize; off += _pk_entry_size(data + off)) {
+        char key[256];
+        memcpy(key, data + off + 3, data[off]);
+        key[data[off]] = '\0';
+        size_t len;
+        const uint8_t* v = _pk_value(data + off, &len);
+        count++;
+        if (!callback(key, v, len, arg)) {
+            break;
+        }
+    }
+    return count;
+}
+
+/*
+ * Get a pointer to a value inside the table, or NULL if there's no such key.
+ * It stays valid until the next call on this object. Values aren't aligned.
+ * */
+
+const void* Preferences::getView(const char* key, size_t* len){
+    if(!_started || !key){
+        return NULL;
+    }
+    _load();
+    const uint8_t* e = _pk_find(_table, _tableSize, key);
+    if (!e) {
+        return NULL;
+    }
+    size_t n;
+    const uint8_t* v = _pk_value(e, &n);
+    if (len) {
+        *len = n;
+    }
+    return v;
+}
+
+size_t Preferences::_readAt(const char* key, size_t offset, void* buf, size_t len){
+    _load();
+    const uint8_t* e = _pk_find(_table, _tableSize, key);
+    size_t n = 0;
+    const uint8_t* v = e ? _pk_value(e, &n) : NULL;
+    if (offset >= n) {
+        return 0;
+    }
+    if (len > n - offset) {
+        len = n - offset;
+    }
+    memcpy(buf, v + offset, len);
+    return len;
+}
+
+/*
+ * Storage figures: the keys come from the table, usage from the filesystem.
+ * A rewrite stages a copy of the file, so that much space must stay free.
+ * */
+
+PreferenceStats Preferences::stats(){
+    PreferenceStats st;
+    memset(&st, 0, sizeof(st));
+    if(!_started){
+        return st;
+    }
+    _load();
+    for (size_t off = sizeof(NVS_PACKED_MAGIC); off < _tableSize; off += _pk_entry_size(_table + off)) {
+        st.entries++;
+    }
+    st.bytesUsed = _tableSize;
+
+    size_t total, used;
+    if (_fs_info(NVS_PATH, &st.blockSize, &total, &used)) {
+        st.bytesFree = total - used;
+        if (st.blockSize) {
+            st.blocksTotal = total / st.blockSize;
+            st.blocksUsed  = used / st.blockSize;
+        }
+    }
+    return st;
+}
+
+// Entries with a 15-character key and an 8-byte value
+size_t Preferences::freeEntries() {
+    if(!_started){
+        return 0;
+    }
+    size_t blockSize, total, used;
+    if (!_fs_info(NVS_PATH, &blockSize, &total, &used)) {
+        return 1000; // unknown
+    }
+    _load();
+    size_t spare = (total - used > _tableSize) ? total - used - _tableSize : 0;
+    return spare / (3 + 15 + 8);
+}
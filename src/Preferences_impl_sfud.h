@@ -1,9 +1,21 @@
-
 /*
  * Preferences are stored in a simple append-only log inside a fixed region
  * of external SPI flash, accessed via `sfud`. There is no real filesystem:
  * put() appends a new entry and drops any previous entry for the same key;
- * clear()/remove() rewrite the region without the dropped entries.
+ * clear()/remove() mark entries as deleted. Each namespace gets a 1-byte ID
+ * the first time it's opened for writing, and entries store that ID instead
+ * of the namespace name.
+ *
+ * The region is a ring of erase sectors. Each sector in use starts with a
+ * sequence number; the log runs from the oldest one to the newest (the head),
+ * and at least one sector is always kept free. When the head fills up, the log
+ * moves on to the next sector. If that leaves no free sector, the live entries
+ * of the oldest sector are copied into the new head and the oldest sector is
+ * retired. Garbage collection only ever erases that one sector, so all sectors
+ * wear at the same rate, and a power loss at any point loses nothing.
+ *
+ * Preferences::maintenance() does this work ahead of time, a sector at a time,
+ * so that put() rarely has to wait for an erase or a garbage collection.
  */
 
 #ifndef SFUD_NVS_FLASH_OFFSET
@@ -18,41 +30,141 @@
 #ifndef SFUD_NVS_MAX_VALUE
   #define SFUD_NVS_MAX_VALUE       1024
 #endif
+#ifndef SFUD_NVS_SECTOR_SIZE
+  #define SFUD_NVS_SECTOR_SIZE     4096    // flash erase granularity
+#endif
+#ifndef SFUD_NVS_PAGE_SIZE
+  #define SFUD_NVS_PAGE_SIZE       256     // flash program granularity (size of the staging buffer)
+#endif
 #ifndef SFUD_NVS_DEVICE_INDEX
   #define SFUD_NVS_DEVICE_INDEX    0
 #endif
+#ifndef SFUD_NVS_MAX_NAMESPACES
+  #define SFUD_NVS_MAX_NAMESPACES  32      // namespace IDs (4 bytes of RAM each), up to 255
+#endif
+#ifndef SFUD_NVS_INDEX_SIZE
+  #define SFUD_NVS_INDEX_SIZE      64      // keys tracked in RAM (6 bytes each), 0 to disable
+#endif
+
+#define SFUD_NVS_SECTORS  (SFUD_NVS_FLASH_SIZE / SFUD_NVS_SECTOR_SIZE)
+
+#if (SFUD_NVS_FLASH_SIZE % SFUD_NVS_SECTOR_SIZE) != 0 || SFUD_NVS_SECTORS < 2 || SFUD_NVS_SECTORS > 32
+  #error "SFUD_NVS_FLASH_SIZE must be 2 to 32 times SFUD_NVS_SECTOR_SIZE"
+#endif
+#if SFUD_NVS_SECTOR_SIZE < 16 + 2 * SFUD_NVS_MAX_NAME + SFUD_NVS_MAX_VALUE + 3
+  #error "SFUD_NVS_SECTOR_SIZE is too small for SFUD_NVS_MAX_VALUE"
+#endif
+#if SFUD_NVS_MAX_NAMESPACES < 1 || SFUD_NVS_MAX_NAMESPACES > 255
+  #error "SFUD_NVS_MAX_NAMESPACES must be 1 to 255"
+#endif
+#if (SFUD_NVS_SECTOR_SIZE % SFUD_NVS_PAGE_SIZE) != 0
+  #error "SFUD_NVS_SECTOR_SIZE must be a multiple of SFUD_NVS_PAGE_SIZE"
+#endif
+
+#if defined(NVS_STATS)
+  #include "prefs_io_stats.h"
+#endif
+
+static const uint32_t SFUD_NVS_MAGIC      = 0x53465042; // "BPFS"
+static const uint32_t SFUD_NVS_NS_MAGIC   = 0x4E465042; // "BPFN"
+static const uint32_t SFUD_NVS_SECT_MAGIC = 0x32465042; // "BPF2"
+static const uint32_t SFUD_NVS_SECT_V1    = 0x52465042; // "BPFR", records with namespace names (see _nvs_migrate())
+static const uint32_t SFUD_NVS_MIG_MAGIC  = 0x4D465042; // "BPFM", conversion of an old log in progress
+static const uint32_t SFUD_NVS_COMMIT_MAGIC = 0x43465042; // "BPFC", batch being activated (see _nvs_put())
+
+/*
+ * Sector layout:
+ *   [magic:4][seq:4][record]...
+ *
+ * magic = SFUD_NVS_SECT_MAGIC : in use, `seq` is its position in the log
+ * magic = 0x00000000          : retired, its live records were moved to a newer sector
+ * anything else               : free (needs an erase, unless it's blank)
+ */
 
-static const uint32_t SFUD_NVS_MAGIC   = 0x53465042; // "BPFS"
+struct _NvsSect {
+    uint32_t magic;
+    uint32_t seq;
+};
 
 /*
  * Record layout (4-byte aligned):
- *   [magic:4][ns_len:1][key_len:1][val_len:2][ns:ns_len][key:key_len][val:val_len][pad]
+ *   [magic:4][ns:1][key_len:1][val_len:2][key:key_len][val:val_len][pad]
+ *
+ * magic = SFUD_NVS_MAGIC    : active record, `ns` is the ID of its namespace
+ * magic = SFUD_NVS_NS_MAGIC : namespace record, the name of namespace `ns` is stored as its key (no value)
+ * magic = SFUD_NVS_COMMIT_MAGIC : end of a batch, its value is the offset of the first record (no key)
+ * magic = 0x00000000        : deleted (written without erase, bits 1->0)
+ * magic = 0xFFFFFFFF        : free (erased flash), or an interrupted write if the rest of the header is set
  *
- * magic = SFUD_NVS_MAGIC  : active record
- * magic = 0x00000000      : deleted (written without erase, bits 1->0)
- * magic = 0xFFFFFFFF      : free (erased flash)
+ * The magic is programmed last, so a record only becomes active once it's complete.
+ * Records never cross a sector boundary.
  */
 
 struct _NvsHdr {
     uint32_t magic;
-    uint8_t  ns_len;
+    uint8_t  ns;
     uint8_t  key_len;
     uint16_t val_len;
 };
 
 static sfud_flash* _sfud_dev;
 static bool        _nvs_ready;
+static uint32_t    _nvs_first;  // oldest sector in use
+static uint32_t    _nvs_last;   // newest sector in use (the head)
+static uint32_t    _nvs_seq;    // sequence number of the head sector
+static uint32_t    _nvs_head;   // offset past the last written record (= start of free space)
+static uint32_t    _nvs_clean;  // bitmask of free sectors known to be erased
+static uint16_t    _nvs_dead[SFUD_NVS_SECTORS]; // bytes taken by deleted records, per sector
+static uint32_t    _nvs_ns_off[SFUD_NVS_MAX_NAMESPACES]; // namespace record of each ID, 0xFFFFFFFF = unused
+static uint32_t    _nvs_wr_off = 0xFFFFFFFF; // record being filled by a PreferenceWriter, 0xFFFFFFFF = none
+static uint8_t     _nvs_old;    // layout of an old log that's served read-only, see _nvs_migrate()
+
+enum { _NVS_OLD_LOG = 1, _NVS_OLD_RING = 2 };
+
+/*
+ * Staging buffer: new records are assembled here and programmed a flash page
+ * at a time, so a record (or a run of records) costs one sfud_write per page
+ * it touches rather than one per field.
+ */
+static uint8_t     _nvs_page[SFUD_NVS_PAGE_SIZE];
+static uint32_t    _nvs_page_off;  // offset of the first staged byte
+static uint32_t    _nvs_page_len;  // number of staged bytes
+
+#if SFUD_NVS_INDEX_SIZE
+/*
+ * In-RAM index: hash of (ns, key) -> offset of its latest active record.
+ * A hit is confirmed with a single header+key read, so lookups don't depend
+ * on the log length. If there are more live keys than slots, the index is
+ * marked incomplete and misses fall back to a full scan of the log.
+ */
+static uint16_t    _nvs_idx_hash[SFUD_NVS_INDEX_SIZE];
+static uint32_t    _nvs_idx_off[SFUD_NVS_INDEX_SIZE];  // 0xFFFFFFFF = empty slot
+static bool        _nvs_idx_full;
+#endif
+
+static uint32_t _rec_size(uint8_t key_len, uint16_t val_len) {
+    return (sizeof(_NvsHdr) + key_len + val_len + 3u) & ~3u;
+}
+
+// Records of an old log have their namespace name (`ns` bytes) in front of the key
+static uint32_t _key_off(uint32_t off, const _NvsHdr& h) {
+    return off + sizeof(h) + (_nvs_old ? h.ns : 0);
+}
 
-static uint32_t _rec_size(uint8_t ns_len, uint8_t key_len, uint16_t val_len) {
-    return (sizeof(_NvsHdr) + ns_len + key_len + val_len + 3u) & ~3u;
+static uint32_t _val_off(uint32_t off, const _NvsHdr& h) {
+    return _key_off(off, h) + h.key_len;
 }
 
 static bool _hdr_valid(const _NvsHdr& h) {
-    return h.ns_len  <= SFUD_NVS_MAX_NAME  &&
-           h.key_len <= SFUD_NVS_MAX_NAME  &&
+    return h.ns      <  SFUD_NVS_MAX_NAMESPACES &&
+           h.key_len <= SFUD_NVS_MAX_NAME       &&
            h.val_len <= SFUD_NVS_MAX_VALUE;
 }
 
+static bool _hdr_free(const _NvsHdr& h) {
+    return h.magic == 0xFFFFFFFF && h.ns == 0xFF && h.key_len == 0xFF && h.val_len == 0xFFFF;
+}
+
 static uint8_t _nvs_name_len(const char* name) {
     if (!name) return 0;
     size_t n = strlen(name);
@@ -60,120 +172,853 @@ static uint8_t _nvs_name_len(const char* name) {
     return (uint8_t)n;
 }
 
-// Returns offset past the last written record (= start of free space)
-static uint32_t _nvs_end() {
-    uint32_t off = 0;
-    while (off + sizeof(_NvsHdr) <= (uint32_t)SFUD_NVS_FLASH_SIZE) {
-        _NvsHdr h;
-        sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + off, sizeof(h), (uint8_t*)&h);
-        if (h.magic == 0xFFFFFFFF) break;
-        if (!_hdr_valid(h)) break; // corrupted
-        off += _rec_size(h.ns_len, h.key_len, h.val_len);
+static uint32_t _sect_start(uint32_t s) {
+    return s * SFUD_NVS_SECTOR_SIZE + sizeof(_NvsSect);
+}
+
+static uint32_t _sect_end(uint32_t s) {
+    return (s + 1) * SFUD_NVS_SECTOR_SIZE;
+}
+
+// Number of sectors in use, including the head
+static uint32_t _nvs_used() {
+    return (_nvs_last + SFUD_NVS_SECTORS - _nvs_first) % SFUD_NVS_SECTORS + 1;
+}
+
+// Reads the header of the record at `*off`, moving on to the next sector when
+// the current one has no more records. Returns false past the end of the log.
+// Walk the log from the oldest record with:
+//   for (off = _sect_start(_nvs_first); _nvs_next(&off, &h); off += _rec_size(...))
+static bool _nvs_next(uint32_t* off, _NvsHdr* h) {
+    for (;;) {
+        uint32_t s   = (*off - 1) / SFUD_NVS_SECTOR_SIZE; // a record may end right at the sector end
+        uint32_t end = (s == _nvs_last) ? _nvs_head : _sect_end(s);
+        if (*off + sizeof(_NvsHdr) <= end) {
+            sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + *off, sizeof(_NvsHdr), (uint8_t*)h);
+            if (!_hdr_free(*h) && _hdr_valid(*h)) return true;
+        }
+        if (s == _nvs_last) return false;
+        *off = _sect_start((s + 1) % SFUD_NVS_SECTORS);
     }
-    return off;
+}
+
+static uint16_t _nvs_hash(uint8_t ns, const char* key, uint8_t key_len) {
+    uint32_t h = 2166136261u; // FNV-1a
+    h = (h ^ ns) * 16777619u;
+    for (uint8_t i = 0; i < key_len; i++) { h = (h ^ (uint8_t)key[i]) * 16777619u; }
+    return (uint16_t)(h ^ (h >> 16));
+}
+
+// Checks that the record at `off` is active, of the given kind, and belongs to (ns, key), with a single read
+static bool _nvs_match(uint32_t off, uint32_t magic, uint8_t ns, const char* key, uint8_t key_len) {
+    uint8_t buf[sizeof(_NvsHdr) + SFUD_NVS_MAX_NAME];
+    _NvsHdr h;
+    if (sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + off, sizeof(_NvsHdr) + key_len, buf) != SFUD_SUCCESS) return false;
+    memcpy(&h, buf, sizeof(h));
+    return h.magic == magic && h.ns == ns && h.key_len == key_len &&
+           memcmp(buf + sizeof(_NvsHdr), key, key_len) == 0;
 }
 
 // Returns offset of the last active record for (ns, key), or 0xFFFFFFFF if not found
-static uint32_t _nvs_find(const char* ns, uint8_t ns_len, const char* key, uint8_t key_len) {
-    uint32_t off = 0, result = 0xFFFFFFFF;
-    uint8_t  nk[SFUD_NVS_MAX_NAME * 2 + 2];
-    uint8_t  nk_len = ns_len + key_len;
-    while (off + sizeof(_NvsHdr) <= (uint32_t)SFUD_NVS_FLASH_SIZE) {
-        _NvsHdr h;
-        sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + off, sizeof(h), (uint8_t*)&h);
-        if (h.magic == 0xFFFFFFFF) break;
-        if (!_hdr_valid(h)) break;
-        if (h.magic == SFUD_NVS_MAGIC && h.ns_len == ns_len && h.key_len == key_len && nk_len <= sizeof(nk)) {
-            sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + off + sizeof(_NvsHdr), nk_len, nk);
-            if (memcmp(nk, ns, ns_len) == 0 && memcmp(nk + ns_len, key, key_len) == 0)
+static uint32_t _nvs_scan(uint8_t ns, const char* key, uint8_t key_len) {
+    uint32_t result = 0xFFFFFFFF;
+    uint8_t  buf[SFUD_NVS_MAX_NAME];
+    _NvsHdr  h;
+    for (uint32_t off = _sect_start(_nvs_first); _nvs_next(&off, &h); off += _rec_size(h.key_len, h.val_len)) {
+        if (h.magic == SFUD_NVS_MAGIC && h.ns == ns && h.key_len == key_len) {
+            sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + off + sizeof(_NvsHdr), key_len, buf);
+            if (memcmp(buf, key, key_len) == 0)
                 result = off;
         }
-        off += _rec_size(h.ns_len, h.key_len, h.val_len);
     }
     return result;
 }
 
+#if SFUD_NVS_INDEX_SIZE
+
+static int _nvs_idx_lookup(uint16_t hash, uint8_t ns, const char* key, uint8_t key_len) {
+    for (int i = 0; i < SFUD_NVS_INDEX_SIZE; i++) {
+        if (_nvs_idx_off[i] != 0xFFFFFFFF && _nvs_idx_hash[i] == hash &&
+            _nvs_match(_nvs_idx_off[i], SFUD_NVS_MAGIC, ns, key, key_len))
+            return i;
+    }
+    return -1;
+}
+
+static int _nvs_idx_slot(uint32_t off) {
+    for (int i = 0; i < SFUD_NVS_INDEX_SIZE; i++) {
+        if (_nvs_idx_off[i] == off) return i;
+    }
+    return -1;
+}
+
+// Points the slot of the record at `old` (or a free slot) to the record at `off`
+static void _nvs_idx_put(uint16_t hash, uint32_t old, uint32_t off) {
+    int i = (old != 0xFFFFFFFF) ? _nvs_idx_slot(old) : -1;
+    if (i < 0) i = _nvs_idx_slot(0xFFFFFFFF);
+    if (i < 0) { _nvs_idx_full = true; return; }
+    _nvs_idx_hash[i] = hash;
+    _nvs_idx_off[i]  = off;
+}
+
+static void _nvs_idx_drop(uint32_t off) {
+    int i = _nvs_idx_slot(off);
+    if (i >= 0) _nvs_idx_off[i] = 0xFFFFFFFF;
+}
+
+#endif
+
+// Returns offset of the last active record for (ns, key), or 0xFFFFFFFF if not found
+static uint32_t _nvs_find(uint8_t ns, const char* key, uint8_t key_len) {
+    if (ns >= SFUD_NVS_MAX_NAMESPACES) return 0xFFFFFFFF; // namespace doesn't exist yet
+#if SFUD_NVS_INDEX_SIZE
+    int i = _nvs_idx_lookup(_nvs_hash(ns, key, key_len), ns, key, key_len);
+    if (i >= 0) return _nvs_idx_off[i];
+    if (!_nvs_idx_full) return 0xFFFFFFFF;
+#endif
+    return _nvs_scan(ns, key, key_len);
+}
+
 static void _nvs_invalidate(uint32_t off) {
     static const uint8_t zeros[4] = {0};
+    _NvsHdr h;
+    sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + off, sizeof(h), (uint8_t*)&h);
     sfud_write(_sfud_dev, SFUD_NVS_FLASH_OFFSET + off, 4, zeros);
+    _nvs_dead[off / SFUD_NVS_SECTOR_SIZE] += _rec_size(h.key_len, h.val_len);
+#if SFUD_NVS_INDEX_SIZE
+    _nvs_idx_drop(off);
+#endif
 }
 
-// Erase region, rewrite only the latest active record for each (ns, key)
-static bool _nvs_compact() {
-    uint8_t* buf = (uint8_t*)malloc(SFUD_NVS_FLASH_SIZE);
-    if (!buf) return false;
+#if SFUD_NVS_INDEX_SIZE
 
-    uint32_t write_off = 0;
-    uint32_t read_off  = 0;
-    while (read_off + sizeof(_NvsHdr) <= (uint32_t)SFUD_NVS_FLASH_SIZE) {
-        _NvsHdr h;
-        sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + read_off, sizeof(h), (uint8_t*)&h);
-        if (h.magic == 0xFFFFFFFF) break;
-        if (!_hdr_valid(h)) break;
-        uint32_t sz = _rec_size(h.ns_len, h.key_len, h.val_len);
+static void _nvs_idx_reset() {
+    for (int i = 0; i < SFUD_NVS_INDEX_SIZE; i++) _nvs_idx_off[i] = 0xFFFFFFFF;
+    _nvs_idx_full = false;
+}
+
+// (Re)build the index with a single pass over the log.
+// If an older active copy of a key is still around (e.g. power was lost
+// between appending a new value and invalidating the old one), drop it now.
+static void _nvs_idx_build() {
+    _nvs_idx_reset();
+
+    _NvsHdr h;
+    for (uint32_t off = _sect_start(_nvs_first); _nvs_next(&off, &h); off += _rec_size(h.key_len, h.val_len)) {
         if (h.magic == SFUD_NVS_MAGIC) {
-            uint8_t nk_len = h.ns_len + h.key_len;
-            uint8_t nk[SFUD_NVS_MAX_NAME * 2 + 2];
-            if (nk_len <= sizeof(nk) &&
-                sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + read_off + sizeof(_NvsHdr), nk_len, nk) == SFUD_SUCCESS &&
-                _nvs_find((char*)nk, h.ns_len, (char*)nk + h.ns_len, h.key_len) == read_off) {
-                if (write_off + sz <= (uint32_t)SFUD_NVS_FLASH_SIZE) {
-                    sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + read_off, sz, buf + write_off);
-                    write_off += sz;
-                }
+            char key[SFUD_NVS_MAX_NAME];
+            sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + off + sizeof(_NvsHdr), h.key_len, (uint8_t*)key);
+            uint16_t hash = _nvs_hash(h.ns, key, h.key_len);
+            int i = _nvs_idx_lookup(hash, h.ns, key, h.key_len);
+            uint32_t old = (i >= 0) ? _nvs_idx_off[i] : 0xFFFFFFFF;
+            _nvs_idx_put(hash, old, off);
+            if (old != 0xFFFFFFFF) _nvs_invalidate(old);
+        }
+    }
+}
+
+#endif
+
+// Copies a record, programming its magic last (see _nvs_commit())
+static bool _nvs_copy(uint32_t from, uint32_t to, uint32_t len) {
+    uint8_t buf[64];
+    for (uint32_t pos = sizeof(uint32_t); pos < len; ) {
+        uint32_t n = (len - pos < sizeof(buf)) ? (len - pos) : sizeof(buf);
+        if (sfud_read(_sfud_dev,  SFUD_NVS_FLASH_OFFSET + from + pos, n, buf) != SFUD_SUCCESS ||
+            sfud_write(_sfud_dev, SFUD_NVS_FLASH_OFFSET + to + pos,   n, buf) != SFUD_SUCCESS) return false;
+        pos += n;
+    }
+    return sfud_read(_sfud_dev,  SFUD_NVS_FLASH_OFFSET + from, sizeof(uint32_t), buf) == SFUD_SUCCESS &&
+           sfud_write(_sfud_dev, SFUD_NVS_FLASH_OFFSET + to,   sizeof(uint32_t), buf) == SFUD_SUCCESS;
+}
+
+// Makes sure a free sector is erased: erase it, unless it's blank already
+static bool _nvs_erase_sect(uint32_t s) {
+    if (_nvs_clean & (1u << s)) return true;
+    uint32_t addr = SFUD_NVS_FLASH_OFFSET + s * SFUD_NVS_SECTOR_SIZE;
+    uint32_t buf[16];
+    bool     blank = true;
+    for (uint32_t off = 0; blank && off < SFUD_NVS_SECTOR_SIZE; off += sizeof(buf)) {
+        sfud_read(_sfud_dev, addr + off, sizeof(buf), (uint8_t*)buf);
+        for (size_t i = 0; i < sizeof(buf) / sizeof(buf[0]); i++) {
+            if (buf[i] != 0xFFFFFFFF) { blank = false; break; }
+        }
+    }
+    if (!blank && sfud_erase(_sfud_dev, addr, SFUD_NVS_SECTOR_SIZE) != SFUD_SUCCESS) return false;
+    _nvs_clean |= (1u << s);
+    return true;
+}
+
+// Starts a new head sector
+static bool _nvs_open_sect() {
+    uint32_t s = (_nvs_last + 1) % SFUD_NVS_SECTORS;
+    if (s == _nvs_first || !_nvs_erase_sect(s)) return false;
+    _nvs_clean &= ~(1u << s);
+    _NvsSect hdr = { SFUD_NVS_SECT_MAGIC, _nvs_seq + 1 };
+    if (sfud_write(_sfud_dev, SFUD_NVS_FLASH_OFFSET + s * SFUD_NVS_SECTOR_SIZE, sizeof(hdr), (const uint8_t*)&hdr) != SFUD_SUCCESS) return false;
+    _nvs_last    = s;
+    _nvs_seq     = hdr.seq;
+    _nvs_head    = _sect_start(s);
+    _nvs_dead[s] = 0;
+    return true;
+}
+
+// Checks that the active record at `off` is the latest copy of its key. A power
+// loss between _nvs_activate() and _nvs_invalidate() leaves an older one active.
+static bool _nvs_latest(uint32_t off, const _NvsHdr& h) {
+    char key[SFUD_NVS_MAX_NAME];
+    if (sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + _key_off(off, h), h.key_len, (uint8_t*)key) != SFUD_SUCCESS) return true;
+    return _nvs_scan(h.ns, key, h.key_len) == off;
+}
+
+// Move the live records of the oldest sector into the head, then retire it.
+// This is a single pass: putBytes() invalidates the previous copy of a key,
+// so an active record is the latest one, unless a power loss left an older
+// copy active. A complete index has dropped those already; otherwise each
+// record is looked up in the log, as a stale copy moved ahead of the latest
+// one would bring the old value back. Namespace records are always live.
+// Records are streamed through a
+// small buffer, and the oldest sector stays in the log until every record
+// has been copied, so an interrupted collection loses nothing.
+static bool _nvs_gc() {
+    uint32_t from = _nvs_first;
+    if (from == _nvs_last) return false;
+    uint32_t off = _sect_start(from);
+    bool     ok  = true;
+    while (ok && off + sizeof(_NvsHdr) <= _sect_end(from)) {
+        _NvsHdr h;
+        sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + off, sizeof(h), (uint8_t*)&h);
+        if (_hdr_free(h) || !_hdr_valid(h)) break;
+        uint32_t sz = _rec_size(h.key_len, h.val_len);
+        if (h.magic == SFUD_NVS_MAGIC || h.magic == SFUD_NVS_NS_MAGIC) {
+#if SFUD_NVS_INDEX_SIZE
+            // With a complete index, an active record that isn't indexed is a stale copy
+            int  i     = (h.magic == SFUD_NVS_MAGIC) ? _nvs_idx_slot(off) : -1;
+            bool stale = h.magic == SFUD_NVS_MAGIC && i < 0 && (!_nvs_idx_full || !_nvs_latest(off, h));
+#else
+            bool stale = h.magic == SFUD_NVS_MAGIC && !_nvs_latest(off, h);
+#endif
+            if (stale) {
+                off += sz;
+                continue;
             }
+            if (_nvs_head + sz > _sect_end(_nvs_last)) { LOG_E("no room to collect sector %u", from); return false; }
+            ok = _nvs_copy(off, _nvs_head, sz);
+#if SFUD_NVS_INDEX_SIZE
+            if (ok && i >= 0) _nvs_idx_off[i] = _nvs_head;
+#endif
+            if (ok && h.magic == SFUD_NVS_NS_MAGIC) _nvs_ns_off[h.ns] = _nvs_head;
+            _nvs_head += sz;
         }
-        read_off += sz;
+        off += sz;
     }
+    if (!ok) { LOG_E("sector copy failed"); return false; }
+
+    // A value being streamed into this sector is lost, along with its staged bytes
+    if (_nvs_wr_off != 0xFFFFFFFF && _nvs_wr_off / SFUD_NVS_SECTOR_SIZE == from) _nvs_wr_off = 0xFFFFFFFF;
+    if (_nvs_page_len && _nvs_page_off / SFUD_NVS_SECTOR_SIZE == from) _nvs_page_len = 0;
+
+    static const uint8_t zeros[4] = {0};
+    sfud_write(_sfud_dev, SFUD_NVS_FLASH_OFFSET + from * SFUD_NVS_SECTOR_SIZE, sizeof(zeros), zeros);
+    _nvs_dead[from] = 0;
+    _nvs_first = (from + 1) % SFUD_NVS_SECTORS;
+    return true;
+}
+
+// Moves the log on to a new head sector, collecting the oldest sector
+// if that would leave no free one
+static bool _nvs_advance() {
+    if (!_nvs_open_sect()) return false;
+    if (_nvs_used() == SFUD_NVS_SECTORS) return _nvs_gc();
+    return true;
+}
 
-    sfud_erase(_sfud_dev, SFUD_NVS_FLASH_OFFSET, SFUD_NVS_FLASH_SIZE);
-    if (write_off > 0)
-        sfud_write(_sfud_dev, SFUD_NVS_FLASH_OFFSET, write_off, buf);
-    free(buf);
+// Programs the staged bytes
+static bool _nvs_flush() {
+    if (!_nvs_page_len) return true;
+    uint32_t base = SFUD_NVS_FLASH_OFFSET + _nvs_page_off;
+    sfud_err err  = sfud_write(_sfud_dev, base, _nvs_page_len, _nvs_page);
+    _nvs_page_len = 0;
+    if (err != SFUD_SUCCESS) { LOG_E("sfud_write failed at 0x%08X", base); return false; }
     return true;
 }
 
-static bool _nvs_append(const char* ns, uint8_t ns_len, const char* key, uint8_t key_len, const void* val, uint16_t val_len, bool* compacted) {
-    *compacted = false;
-    uint32_t end = _nvs_end();
-    uint32_t sz  = _rec_size(ns_len, key_len, val_len);
-    if (end + sz > (uint32_t)SFUD_NVS_FLASH_SIZE) {
-        LOG_I("compacting flash log");
-        if (!_nvs_compact()) return false;
-        *compacted = true;
-        end = _nvs_end();
-        if (end + sz > (uint32_t)SFUD_NVS_FLASH_SIZE) { LOG_E("flash full"); return false; }
-    }
-    uint32_t base = SFUD_NVS_FLASH_OFFSET + end;
-    _NvsHdr h = { SFUD_NVS_MAGIC, ns_len, key_len, val_len };
-    if (sfud_write(_sfud_dev, base,                                  sizeof(h), (const uint8_t*)&h)  != SFUD_SUCCESS ||
-        sfud_write(_sfud_dev, base + sizeof(h),                      ns_len,   (const uint8_t*)ns)   != SFUD_SUCCESS ||
-        sfud_write(_sfud_dev, base + sizeof(h) + ns_len,             key_len,  (const uint8_t*)key)  != SFUD_SUCCESS ||
-        (val_len > 0 &&
-         sfud_write(_sfud_dev, base + sizeof(h) + ns_len + key_len, val_len,  (const uint8_t*)val)  != SFUD_SUCCESS)) {
-        LOG_E("sfud_write failed at 0x%08X", base);
+// Stages `len` bytes to be programmed at `off`. Each page is programmed as soon as it's complete.
+static bool _nvs_stage(uint32_t off, const void* data, uint32_t len) {
+    const uint8_t* p = (const uint8_t*)data;
+    if (_nvs_page_len && off != _nvs_page_off + _nvs_page_len && !_nvs_flush()) return false;
+    while (len > 0) {
+        if (!_nvs_page_len) _nvs_page_off = off;
+        uint32_t room = SFUD_NVS_PAGE_SIZE - (SFUD_NVS_FLASH_OFFSET + off) % SFUD_NVS_PAGE_SIZE;
+        uint32_t n    = (len < room) ? len : room;
+        memcpy(_nvs_page + _nvs_page_len, p, n);
+        _nvs_page_len += n;
+        off += n;
+        p   += n;
+        len -= n;
+        if (n == room && !_nvs_flush()) return false;
+    }
+    return true;
+}
+
+// Stages a record at `off`, leaving its magic erased (see _nvs_commit())
+static bool _nvs_stage_rec(uint32_t off, uint8_t ns, const char* key, uint8_t key_len, const void* val, uint16_t val_len) {
+    static const uint8_t pad[3] = { 0xFF, 0xFF, 0xFF };
+    _NvsHdr  h   = { 0xFFFFFFFF, ns, key_len, val_len };
+    uint32_t len = sizeof(h) + key_len + val_len;
+    return _nvs_stage(off,                     &h,  sizeof(h)) &&
+           _nvs_stage(off + sizeof(h),         key, key_len)   &&
+           _nvs_stage(off + sizeof(h) + key_len, val, val_len) &&
+           _nvs_stage(off + len, pad, _rec_size(key_len, val_len) - len);
+}
+
+// Programs the magic of a staged record, which makes it active
+static bool _nvs_activate(uint32_t off, uint32_t magic) {
+    if (sfud_write(_sfud_dev, SFUD_NVS_FLASH_OFFSET + off, sizeof(magic), (const uint8_t*)&magic) != SFUD_SUCCESS) {
+        LOG_E("sfud_write failed at 0x%08X", SFUD_NVS_FLASH_OFFSET + off);
         return false;
     }
     return true;
 }
 
-// Scan the region; erase it if the content looks corrupt (not erased-flash and not valid records).
-// This handles the case where the region was never erased (factory state, SPIFFS remnants, etc.)
-// and sfud_write would silently fail to program 1-bits over existing 0-bits.
-static void _nvs_check_region() {
-    uint32_t off = 0;
-    while (off + sizeof(_NvsHdr) <= (uint32_t)SFUD_NVS_FLASH_SIZE) {
-        _NvsHdr h;
+// Makes room for a record at the head. `old` is the record it supersedes (0xFFFFFFFF if none);
+// garbage collection relocates records, so it is updated to the current offset of that record.
+static bool _nvs_reserve(uint32_t sz, uint8_t ns, const char* key, uint8_t key_len, uint32_t* old) {
+    for (int i = 0; _nvs_used() == SFUD_NVS_SECTORS || _nvs_head + sz > _sect_end(_nvs_last); i++) {
+        // A collection that failed is done first: until then, the head only holds its copies
+        bool ok = (i < SFUD_NVS_SECTORS) && (_nvs_used() == SFUD_NVS_SECTORS ? _nvs_gc() : _nvs_advance());
+        if (!ok) { LOG_E("flash full"); return false; }
+        if (*old != 0xFFFFFFFF) *old = _nvs_find(ns, key, key_len);
+    }
+    return true;
+}
+
+// Activates a staged record: its magic is programmed last, so a record only
+// becomes active once it's complete, and its previous copy (`old`, 0xFFFFFFFF
+// if none) is dropped right after.
+static bool _nvs_commit(uint32_t off, uint32_t old, uint16_t hash) {
+    if (!_nvs_flush() || !_nvs_activate(off, SFUD_NVS_MAGIC)) return false;
+#if SFUD_NVS_INDEX_SIZE
+    _nvs_idx_put(hash, old, off);
+#else
+    (void)hash;
+#endif
+    if (old != 0xFFFFFFFF) _nvs_invalidate(old);
+    return true;
+}
+
+// Checks if the record at `off` already holds this value
+static bool _nvs_same(uint32_t off, const void* val, size_t len) {
+    if (off == 0xFFFFFFFF) return false;
+    _NvsHdr h;
+    sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + off, sizeof(h), (uint8_t*)&h);
+    if (h.val_len != len) return false;
+    if (len == 0) return true;
+    uint8_t tmp[SFUD_NVS_MAX_VALUE];
+    sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + _val_off(off, h), len, tmp);
+    return memcmp(tmp, val, len) == 0;
+}
+
+// Activates the records of a batch, from `start` up to its commit record at
+// `mark`, then retires that. At boot the index isn't built yet: it's left
+// alone, and the previous copies are looked up in the log.
+static bool _nvs_finish(uint32_t start, uint32_t mark, bool boot) {
+    _NvsHdr h;
+    for (uint32_t off = start; off < mark; off += _rec_size(h.key_len, h.val_len)) {
+        char key[SFUD_NVS_MAX_NAME];
         sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + off, sizeof(h), (uint8_t*)&h);
-        if (h.magic == 0xFFFFFFFF) return; // erased flash, all good
-        if ((h.magic == SFUD_NVS_MAGIC || h.magic == 0x00000000) && _hdr_valid(h)) {
-            off += _rec_size(h.ns_len, h.key_len, h.val_len);
-            continue;
+        if (!_hdr_valid(h)) return false;
+        if (h.magic == SFUD_NVS_MAGIC) continue; // done before a power loss
+        sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + off + sizeof(h), h.key_len, (uint8_t*)key);
+        if (boot) {
+            uint32_t old = _nvs_scan(h.ns, key, h.key_len);
+            if (!_nvs_activate(off, SFUD_NVS_MAGIC)) return false;
+            if (old != 0xFFFFFFFF) _nvs_invalidate(old);
+        } else if (!_nvs_commit(off, _nvs_find(h.ns, key, h.key_len), _nvs_hash(h.ns, key, h.key_len))) {
+            return false;
         }
-        LOG_W("NVS region corrupt, erasing");
-        sfud_erase(_sfud_dev, SFUD_NVS_FLASH_OFFSET, SFUD_NVS_FLASH_SIZE);
-        return;
     }
+    _nvs_invalidate(mark);
+    return true;
+}
+
+// Checks if a later entry of the batch sets the same key: the last value wins
+static bool _nvs_superseded(const PreferenceEntry* entries, size_t i, size_t count) {
+    for (size_t j = i + 1; j < count; j++) {
+        if (!strcmp(entries[i].key, entries[j].key)) return true;
+    }
+    return false;
+}
+
+// Stores a batch of values in namespace `ns`, all or nothing. The changed values
+// are staged back-to-back in the head sector and programmed a page at a time,
+// followed by a commit record pointing back to the first one. They're activated
+// once its magic is programmed: if power is lost before that, none of them is,
+// and after that, the batch is finished at the next boot (see _nvs_recover()).
+// A single changed value needs no commit record. A batch must fit in a sector.
+// Returns `count`, or 0 if nothing was stored.
+static size_t _nvs_put(uint8_t ns, const PreferenceEntry* entries, size_t count) {
+    uint32_t total   = 0;
+    size_t   changed = 0, last = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!_nvs_name_len(entries[i].key) || (!entries[i].value && entries[i].length > 0) ||
+            entries[i].length > SFUD_NVS_MAX_VALUE) return 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+        const PreferenceEntry& e = entries[i];
+        uint8_t key_len = _nvs_name_len(e.key);
+        if (_nvs_superseded(entries, i, count) || _nvs_same(_nvs_find(ns, e.key, key_len), e.value, e.length)) continue;
+        total += _rec_size(key_len, (uint16_t)e.length);
+        changed++;
+        last = i;
+    }
+    if (!changed) return count; // unchanged, skip write
+
+    uint32_t mark = total;
+    if (changed > 1) total += _rec_size(0, sizeof(uint32_t));
+    if (total > SFUD_NVS_SECTOR_SIZE - sizeof(_NvsSect)) { LOG_E("batch doesn't fit in a sector"); return 0; }
+    uint32_t none = 0xFFFFFFFF;
+    if (!_nvs_reserve(total, ns, NULL, 0, &none)) return 0;
+    uint32_t start = _nvs_head;
+    _nvs_head = start + total; // may be partially programmed on failure, never write over it
+    mark += start;
+
+    uint32_t off = start;
+    for (size_t i = 0; i < count; i++) {
+        const PreferenceEntry& e = entries[i];
+        uint8_t key_len = _nvs_name_len(e.key);
+        if (_nvs_superseded(entries, i, count) || _nvs_same(_nvs_find(ns, e.key, key_len), e.value, e.length)) continue;
+        if (!_nvs_stage_rec(off, ns, e.key, key_len, e.value, (uint16_t)e.length)) return 0;
+        off += _rec_size(key_len, (uint16_t)e.length);
+    }
+    if (changed == 1) {
+        uint8_t key_len = _nvs_name_len(entries[last].key);
+        uint32_t old = _nvs_find(ns, entries[last].key, key_len);
+        return _nvs_commit(start, old, _nvs_hash(ns, entries[last].key, key_len)) ? count : 0;
+    }
+    bool ok = _nvs_stage_rec(mark, ns, NULL, 0, &start, sizeof(start)) && _nvs_flush() &&
+              _nvs_activate(mark, SFUD_NVS_COMMIT_MAGIC);
+    if (!ok) return 0;
+    _nvs_finish(start, mark, false);
+    return count;
+}
+
+// Finishes a batch whose commit record was programmed before a power loss (see _nvs_put())
+static void _nvs_recover() {
+    _NvsHdr h;
+    for (uint32_t off = _sect_start(_nvs_first); _nvs_next(&off, &h); off += _rec_size(h.key_len, h.val_len)) {
+        uint32_t start;
+        if (h.magic != SFUD_NVS_COMMIT_MAGIC || h.val_len != sizeof(start) ||
+            sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + _val_off(off, h), sizeof(start), (uint8_t*)&start) != SFUD_SUCCESS) continue;
+        if (start >= _sect_start(off / SFUD_NVS_SECTOR_SIZE) && start < off) {
+            LOG_I("finishing the batch at 0x%08X", start);
+            _nvs_finish(start, off, true);
+        }
+    }
+}
+
+// Returns the ID of a namespace, or 0xFF if it doesn't exist
+static uint8_t _nvs_ns_find(const char* name, uint8_t len) {
+    for (uint8_t id = 0; id < SFUD_NVS_MAX_NAMESPACES; id++) {
+        if (_nvs_ns_off[id] != 0xFFFFFFFF && _nvs_match(_nvs_ns_off[id], SFUD_NVS_NS_MAGIC, id, name, len))
+            return id;
+    }
+    return 0xFF;
+}
+
+// Adds a namespace record, returns the new ID or 0xFF
+static uint8_t _nvs_ns_add(const char* name, uint8_t len) {
+    uint8_t id = 0;
+    while (id < SFUD_NVS_MAX_NAMESPACES && _nvs_ns_off[id] != 0xFFFFFFFF) id++;
+    if (id == SFUD_NVS_MAX_NAMESPACES) { LOG_E("too many namespaces"); return 0xFF; }
+    uint32_t sz  = _rec_size(len, 0);
+    uint32_t old = 0xFFFFFFFF;
+    if (!_nvs_reserve(sz, id, name, len, &old)) return 0xFF;
+    uint32_t off = _nvs_head;
+    _nvs_head = off + sz;
+    if (!_nvs_stage_rec(off, id, name, len, NULL, 0) || !_nvs_flush() || !_nvs_activate(off, SFUD_NVS_NS_MAGIC)) return 0xFF;
+    _nvs_ns_off[id] = off;
+    return id;
+}
+
+// Namespace ID of an open Preferences object. A read-only object may be opened
+// before its namespace exists, so keep looking it up until it does.
+static uint8_t _nvs_ns(const String& name, uint8_t* id) {
+    if (*id == 0xFF) *id = _nvs_ns_find(name.c_str(), (uint8_t)name.length());
+    return *id;
+}
+
+// Start over with an empty log in the first sector
+static bool _nvs_init_region() {
+    _NvsSect hdr = { SFUD_NVS_SECT_MAGIC, 1 };
+    if (sfud_erase(_sfud_dev, SFUD_NVS_FLASH_OFFSET, SFUD_NVS_FLASH_SIZE) != SFUD_SUCCESS ||
+        sfud_write(_sfud_dev, SFUD_NVS_FLASH_OFFSET, sizeof(hdr), (const uint8_t*)&hdr) != SFUD_SUCCESS) {
+        LOG_E("cannot initialize NVS region");
+        return false;
+    }
+    _nvs_first = _nvs_last = 0;
+    _nvs_seq   = hdr.seq;
+    _nvs_head  = _sect_start(0);
+    _nvs_clean = ~1u;
+    memset(_nvs_dead, 0, sizeof(_nvs_dead));
+    memset(_nvs_ns_off, 0xFF, sizeof(_nvs_ns_off));
+    _nvs_wr_off = 0xFFFFFFFF;
+#if SFUD_NVS_INDEX_SIZE
+    _nvs_idx_reset();
+#endif
+    return true;
+}
+
+// Old records store the namespace name (`ns` bytes) in front of the key
+static uint32_t _v1_size(const _NvsHdr& h) {
+    return (sizeof(_NvsHdr) + h.ns + h.key_len + h.val_len + 3u) & ~3u;
+}
+
+static bool _v1_valid(const _NvsHdr& h) {
+    return h.ns      <= SFUD_NVS_MAX_NAME &&
+           h.key_len <= SFUD_NVS_MAX_NAME &&
+           h.val_len <= SFUD_NVS_MAX_VALUE;
+}
+
+// Where the records of the log start, see _nvs_next() and _v1_next()
+static uint32_t _log_start() {
+    return (_nvs_old == _NVS_OLD_LOG) ? 0 : _sect_start(_nvs_first);
+}
+
+// Like _nvs_next(), over the records of an old log (_nvs_old is its layout)
+static bool _v1_next(uint32_t* off, _NvsHdr* h) {
+    for (;;) {
+        bool     ring = (_nvs_old == _NVS_OLD_RING);
+        uint32_t s    = ring ? (*off - 1) / SFUD_NVS_SECTOR_SIZE : 0;
+        uint32_t end  = ring ? _sect_end(s) : SFUD_NVS_FLASH_SIZE;
+        if (*off + sizeof(_NvsHdr) <= end) {
+            sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + *off, sizeof(_NvsHdr), (uint8_t*)h);
+            if (!_hdr_free(*h) && _v1_valid(*h) && *off + _v1_size(*h) <= end) return true;
+        }
+        if (!ring || s == _nvs_last) return false;
+        *off = _sect_start((s + 1) % SFUD_NVS_SECTORS);
+    }
+}
+
+static bool _log_next(uint32_t* off, _NvsHdr* h) {
+    return _nvs_old ? _v1_next(off, h) : _nvs_next(off, h);
+}
+
+static uint32_t _log_size(const _NvsHdr& h) {
+    return _nvs_old ? _v1_size(h) : _rec_size(h.key_len, h.val_len);
+}
+
+// Checks that the old record at `off` belongs to namespace `name`
+static bool _v1_in(uint32_t off, const char* name, uint8_t len) {
+    char    buf[SFUD_NVS_MAX_NAME];
+    _NvsHdr h;
+    sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + off, sizeof(h), (uint8_t*)&h);
+    if (h.ns != len) return false;
+    sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + off + sizeof(h), len, (uint8_t*)buf);
+    return memcmp(buf, name, len) == 0;
+}
+
+// Returns offset of the last active old record for (namespace name, key), or 0xFFFFFFFF if not found
+static uint32_t _v1_find(const char* name, uint8_t len, const char* key, uint8_t key_len) {
+    uint32_t result = 0xFFFFFFFF;
+    uint8_t  buf[SFUD_NVS_MAX_NAME];
+    _NvsHdr  h;
+    for (uint32_t off = _log_start(); _v1_next(&off, &h); off += _v1_size(h)) {
+        if (h.magic == SFUD_NVS_MAGIC && h.ns == len && h.key_len == key_len) {
+            sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + off + sizeof(h) + len, key_len, buf);
+            if (memcmp(buf, key, key_len) == 0 && _v1_in(off, name, len))
+                result = off;
+        }
+    }
+    return result;
+}
+
+/*
+ * Older versions of the library stored the namespace name in every record: first
+ * as a single log over the whole region with no sector headers, then as a ring of
+ * SFUD_NVS_SECT_V1 sectors. Their live records are converted into a new log in
+ * the sectors that the old one doesn't use, a sector at a time. The first record
+ * of the new log is a SFUD_NVS_MIG_MAGIC marker, cleared once every record is in:
+ * until then the old log is left as it is, and an interrupted conversion starts
+ * over. Its sectors are free from then on.
+ *
+ * A single log may use every sector. Then the new sector is assembled in the
+ * erased space after the old log, with a SFUD_NVS_MIG_MAGIC trailer at the end
+ * of the region, and copied to the first sector once it's complete.
+ *
+ * If the records don't fit, the old log is kept and served read-only.
+ */
+
+struct _NvsMig {
+    uint32_t dst[SFUD_NVS_SECTORS]; // where each sector of the new log goes
+    uint32_t count;                 // number of sectors available
+    bool     image;                 // a single sector, assembled after the old log
+    bool     write;                 // false: only check that the records fit
+    uint32_t k;                     // sector being filled
+    uint32_t head;                  // offset in it
+};
+
+// Programs `len` bytes and reads them back: the space may not be erased
+static bool _mig_write(uint32_t off, const void* data, uint32_t len) {
+    const uint8_t* p = (const uint8_t*)data;
+    uint8_t buf[64];
+    if (sfud_write(_sfud_dev, SFUD_NVS_FLASH_OFFSET + off, len, p) != SFUD_SUCCESS) return false;
+    for (uint32_t pos = 0; pos < len; pos += sizeof(buf)) {
+        uint32_t n = (len - pos < sizeof(buf)) ? (len - pos) : sizeof(buf);
+        if (sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + off + pos, n, buf) != SFUD_SUCCESS ||
+            memcmp(buf, p + pos, n) != 0) return false;
+    }
+    return true;
+}
+
+// Writes a converted record: its key (or name) and value come from the old record, the header goes last
+static bool _mig_rec(uint32_t to, const _NvsHdr& h, uint32_t from, uint32_t len) {
+    uint8_t buf[64];
+    for (uint32_t pos = 0; pos < len; pos += sizeof(buf)) {
+        uint32_t n = (len - pos < sizeof(buf)) ? (len - pos) : sizeof(buf);
+        if (sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + from + pos, n, buf) != SFUD_SUCCESS ||
+            !_mig_write(to + sizeof(h) + pos, buf, n)) return false;
+    }
+    return _mig_write(to, &h, sizeof(h));
+}
+
+// Starts sector `m.k` of the new log
+static bool _mig_open(_NvsMig& m) {
+    static const _NvsHdr marker = { SFUD_NVS_MIG_MAGIC, 0, 0, 0 };
+    _NvsSect hdr = { SFUD_NVS_SECT_MAGIC, m.k + 1 };
+    bool     mark = (m.k == 0 && !m.image);
+    m.head = sizeof(_NvsSect) + (mark ? sizeof(marker) : 0);
+    if (!m.write) return true;
+    // The marker goes first: a new log is never seen without it
+    return (m.image || _nvs_erase_sect(m.dst[m.k] / SFUD_NVS_SECTOR_SIZE)) &&
+           (!mark || _mig_write(m.dst[m.k] + sizeof(_NvsSect), &marker, sizeof(marker))) &&
+           _mig_write(m.dst[m.k], &hdr, sizeof(hdr));
+}
+
+// Returns where the next `sz` bytes of the new log go, or 0xFFFFFFFF if they don't fit
+static uint32_t _mig_place(_NvsMig& m, uint32_t sz) {
+    if (m.head + sz > SFUD_NVS_SECTOR_SIZE) {
+        if (++m.k == m.count || !_mig_open(m)) return 0xFFFFFFFF;
+    }
+    uint32_t off = m.dst[m.k] + m.head;
+    m.head += sz;
+    return off;
+}
+
+// Converts the live records of the old log, or only checks that they fit
+static bool _mig_convert(_NvsMig& m) {
+    uint32_t ns_from[SFUD_NVS_MAX_NAMESPACES]; // first old record of each namespace
+    uint8_t  ns_count = 0;
+    m.k = 0;
+    if (!_mig_open(m)) return false;
+    _NvsHdr h;
+    for (uint32_t off = _log_start(); _v1_next(&off, &h); off += _v1_size(h)) {
+        if (h.magic != SFUD_NVS_MAGIC || !h.ns || !h.key_len) continue;
+        char name[SFUD_NVS_MAX_NAME];
+        sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + off + sizeof(h), h.ns, (uint8_t*)name);
+        uint8_t id = 0;
+        while (id < ns_count && !_v1_in(ns_from[id], name, h.ns)) id++;
+        if (id == ns_count) {
+            if (id == SFUD_NVS_MAX_NAMESPACES) { LOG_E("too many namespaces"); return false; }
+            _NvsHdr  nh = { SFUD_NVS_NS_MAGIC, id, h.ns, 0 };
+            uint32_t to = _mig_place(m, _rec_size(h.ns, 0));
+            if (to == 0xFFFFFFFF || (m.write && !_mig_rec(to, nh, off + sizeof(h), h.ns))) return false;
+            ns_from[ns_count++] = off;
+        }
+        _NvsHdr  nh = { SFUD_NVS_MAGIC, id, h.key_len, h.val_len };
+        uint32_t to = _mig_place(m, _rec_size(h.key_len, h.val_len));
+        if (to == 0xFFFFFFFF || (m.write && !_mig_rec(to, nh, _key_off(off, h), h.key_len + h.val_len))) return false;
+    }
+    return true;
+}
+
+// Length of a new sector assembled after a single log (see above), 0 if there's none
+static uint32_t _mig_image() {
+    uint32_t trailer[2];
+    sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + SFUD_NVS_FLASH_SIZE - sizeof(trailer), sizeof(trailer), (uint8_t*)trailer);
+    bool ok = trailer[1] == SFUD_NVS_MIG_MAGIC && trailer[0] >= sizeof(_NvsSect) &&
+              trailer[0] <= SFUD_NVS_SECTOR_SIZE && (trailer[0] % 4) == 0;
+    return ok ? trailer[0] : 0;
+}
+
+// Copies that sector to the first one, its header last
+static bool _mig_copy_image(uint32_t len) {
+    uint32_t from = SFUD_NVS_FLASH_SIZE - 2 * sizeof(uint32_t) - len;
+    return sfud_erase(_sfud_dev, SFUD_NVS_FLASH_OFFSET, SFUD_NVS_SECTOR_SIZE) == SFUD_SUCCESS &&
+           _nvs_copy(from, 0, len);
+}
+
+// Checks if the log starting at sector `s` is a conversion that didn't finish
+static bool _mig_marked(uint32_t s) {
+    uint32_t magic;
+    return sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + _sect_start(s), sizeof(magic), (uint8_t*)&magic) == SFUD_SUCCESS &&
+           magic == SFUD_NVS_MIG_MAGIC;
+}
+
+static bool _nvs_migrate() {
+    _NvsMig m;
+    memset(&m, 0, sizeof(m));
+
+    // Sectors past the old log are free. A single log starts at sector 0, and
+    // the sector where it ends keeps the erased header that ends it.
+    uint32_t used, last, end = 0;
+    _NvsHdr  h;
+    if (_nvs_old == _NVS_OLD_RING) {
+        used = (_nvs_last + SFUD_NVS_SECTORS - _nvs_first) % SFUD_NVS_SECTORS + 1;
+        last = _nvs_last;
+    } else {
+        while (_v1_next(&end, &h)) end += _v1_size(h);
+        bool erased = end + sizeof(h) <= SFUD_NVS_FLASH_SIZE;
+        if (erased) {
+            sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + end, sizeof(h), (uint8_t*)&h);
+            erased = _hdr_free(h);
+        }
+        used = erased ? end / SFUD_NVS_SECTOR_SIZE + 1 : SFUD_NVS_SECTORS;
+        last = used - 1;
+        m.image = (used == SFUD_NVS_SECTORS) && erased;
+    }
+    m.count = m.image ? 1 : SFUD_NVS_SECTORS - used;
+    for (uint32_t k = 0; k < m.count && !m.image; k++) {
+        m.dst[k] = ((last + 1 + k) % SFUD_NVS_SECTORS) * SFUD_NVS_SECTOR_SIZE;
+    }
+    if (!m.count || !_mig_convert(m)) return false;
+
+    uint32_t trailer[2] = { m.head, SFUD_NVS_MIG_MAGIC };
+    if (m.image) {
+        m.dst[0] = SFUD_NVS_FLASH_SIZE - sizeof(trailer) - m.head;
+        if (m.dst[0] < end + sizeof(h)) return false;
+    } else {
+        // Last to first: whatever an interrupted conversion left starts with its marker
+        _nvs_clean = 0;
+        for (uint32_t k = m.count; k-- > 0; ) {
+            if (!_nvs_erase_sect(m.dst[k] / SFUD_NVS_SECTOR_SIZE)) return false;
+        }
+    }
+    m.write = true;
+    if (!_mig_convert(m)) { LOG_E("cannot convert the old log"); return false; }
+    if (m.image) {
+        return _mig_write(SFUD_NVS_FLASH_SIZE - sizeof(trailer), trailer, sizeof(trailer)) &&
+               _mig_copy_image(m.head);
+    }
+    static const uint8_t zeros[4] = {0};
+    return sfud_write(_sfud_dev, SFUD_NVS_FLASH_OFFSET + m.dst[0] + sizeof(_NvsSect), sizeof(zeros), zeros) == SFUD_SUCCESS;
+}
+
+// The log is the run of sectors tagged with `magic` that have consecutive sequence numbers,
+// and ends at the newest one (the head). Returns the head, or -1 if there's no such sector.
+static int _nvs_find_log(const _NvsSect* sect, uint32_t magic, uint32_t* first) {
+    int last = -1;
+    for (uint32_t s = 0; s < SFUD_NVS_SECTORS; s++) {
+        if (sect[s].magic == magic && (last < 0 || (int32_t)(sect[s].seq - sect[last].seq) > 0))
+            last = s;
+    }
+    if (last < 0) return -1;
+    *first = last;
+    for (;;) {
+        uint32_t prev = (*first + SFUD_NVS_SECTORS - 1) % SFUD_NVS_SECTORS;
+        if (prev == (uint32_t)last || sect[prev].magic != magic || sect[prev].seq != sect[*first].seq - 1) break;
+        *first = prev;
+    }
+    return last;
+}
+
+static void _nvs_read_sects(_NvsSect* sect) {
+    for (uint32_t s = 0; s < SFUD_NVS_SECTORS; s++) {
+        sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + s * SFUD_NVS_SECTOR_SIZE, sizeof(_NvsSect), (uint8_t*)&sect[s]);
+    }
+}
+
+// Find the sectors of the log and the end of the head sector.
+// If the region holds neither a log nor an old log (factory state, SPIFFS remnants, etc.),
+// erase it: sfud_write would silently fail to program 1-bits over existing 0-bits.
+static bool _nvs_check_region() {
+    _NvsSect sect[SFUD_NVS_SECTORS];
+    _nvs_read_sects(sect);
+    uint32_t first = 0;
+    int      last  = _nvs_find_log(sect, SFUD_NVS_SECT_MAGIC, &first);
+    if (last >= 0 && _mig_marked(first)) last = -1; // the old log is still the one in use
+    _nvs_old = 0;
+
+    uint32_t image = (last < 0) ? _mig_image() : 0;
+    if (image) {
+        LOG_I("finishing the NVS conversion");
+        if (!_mig_copy_image(image)) { LOG_E("cannot convert the old log"); return false; }
+        _nvs_read_sects(sect);
+        last = _nvs_find_log(sect, SFUD_NVS_SECT_MAGIC, &first);
+    }
+    if (last < 0) {
+        _NvsHdr h;
+        memcpy(&h, &sect[0], sizeof(h));
+        int v1_last = _nvs_find_log(sect, SFUD_NVS_SECT_V1, &first);
+        if (v1_last >= 0 || ((h.magic == SFUD_NVS_MAGIC || h.magic == 0x00000000) && _v1_valid(h))) {
+            LOG_I("migrating NVS region");
+            _nvs_old   = (v1_last >= 0) ? _NVS_OLD_RING : _NVS_OLD_LOG;
+            _nvs_first = first;
+            _nvs_last  = (v1_last >= 0) ? v1_last : 0;
+            if (!_nvs_migrate()) {
+                LOG_W("old NVS data doesn't fit the new layout, it's read-only");
+                return true;
+            }
+            _nvs_old = 0;
+            _nvs_read_sects(sect);
+            last = _nvs_find_log(sect, SFUD_NVS_SECT_MAGIC, &first);
+        }
+    }
+    if (last < 0) {
+        if (sect[0].magic != 0xFFFFFFFF) { LOG_W("NVS region corrupt, erasing"); }
+        return _nvs_init_region();
+    }
+
+    // No free sector: power was lost during a garbage collection (see _nvs_advance()).
+    // The head holds nothing but copies of records of the oldest sector, and maybe a
+    // torn one that would leave no room to finish. Retire it, the collection is done
+    // again when the log moves on.
+    if ((last + SFUD_NVS_SECTORS - first) % SFUD_NVS_SECTORS + 1 == SFUD_NVS_SECTORS) {
+        static const uint8_t zeros[4] = {0};
+        sfud_write(_sfud_dev, SFUD_NVS_FLASH_OFFSET + last * SFUD_NVS_SECTOR_SIZE, sizeof(zeros), zeros);
+        last = (last + SFUD_NVS_SECTORS - 1) % SFUD_NVS_SECTORS;
+    }
+
+    // Sectors outside of the log are free, and get erased before they're used.
+    _nvs_first = first;
+    _nvs_last  = last;
+    _nvs_seq   = sect[last].seq;
+    _nvs_clean = 0; // unknown, checked before use
+    _nvs_head  = _sect_end(last);
+    _nvs_recover();
+    memset(_nvs_dead, 0, sizeof(_nvs_dead));
+    memset(_nvs_ns_off, 0xFF, sizeof(_nvs_ns_off));
+    _nvs_wr_off = 0xFFFFFFFF;
+
+    for (uint32_t s = first; ; s = (s + 1) % SFUD_NVS_SECTORS) {
+        uint32_t off = _sect_start(s);
+        uint32_t end = _sect_end(s);
+        while (off + sizeof(_NvsHdr) <= end) {
+            _NvsHdr h;
+            sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + off, sizeof(h), (uint8_t*)&h);
+            if (_hdr_free(h)) break; // erased flash, all good
+            bool live = (h.magic == SFUD_NVS_MAGIC || h.magic == SFUD_NVS_NS_MAGIC);
+            bool dead = (h.magic == 0x00000000 || h.magic == 0xFFFFFFFF || h.magic == SFUD_NVS_COMMIT_MAGIC);
+            if ((live || dead) && _hdr_valid(h)) {
+                uint32_t sz = _rec_size(h.key_len, h.val_len);
+                if (!live) _nvs_dead[s] += sz;
+                if (h.magic == SFUD_NVS_NS_MAGIC) _nvs_ns_off[h.ns] = off;
+                off += sz;
+                continue;
+            }
+            // Interrupted write: the rest of the sector is unusable. If it's the head,
+            // the next put moves on to a new sector.
+            LOG_W("NVS log corrupt at 0x%08X", off);
+            _nvs_dead[s] += end - off;
+            off = end;
+            break;
+        }
+        if (s == (uint32_t)last) {
+            _nvs_head = (off < end) ? off : end;
+            break;
+        }
+    }
+    return true;
 }
 
 static bool _nvs_init_dev() {
@@ -190,27 +1035,46 @@ static bool _nvs_init_dev() {
         }
         if (!dev || !dev->chip.capacity) { LOG_E("sfud device not ready"); return false; }
         _sfud_dev = dev;
-        if (!_nvs_ready) {
-            _nvs_check_region();
-            _nvs_ready = true;
-        }
+    }
+    if (!_nvs_ready) {
+        if (!_nvs_check_region()) return false;
+#if SFUD_NVS_INDEX_SIZE
+        if (!_nvs_old) _nvs_idx_build();
+#endif
+        _nvs_ready = true;
     }
     return _sfud_dev;
 }
 
+// Finds `key` in namespace `name` (`id` caches its ID), in an old log too
+static uint32_t _nvs_lookup(const String& name, uint8_t* id, const char* key, uint8_t key_len) {
+    if (_nvs_old) return _v1_find(name.c_str(), (uint8_t)name.length(), key, key_len);
+    return _nvs_find(_nvs_ns(name, id), key, key_len);
+}
+
 // --- Preferences member functions ---
 
 bool Preferences::begin(const char* name, bool readOnly) {
-    if (_started || !_nvs_name_len(name)) return false;
+    uint8_t len = _nvs_name_len(name);
+    if (_started || !len) return false;
     if (!_nvs_init_dev()) return false;
+    readOnly = readOnly || _nvs_old;
+    uint8_t id = readOnly ? 0xFF : _nvs_ns_find(name, len);
+    if (id == 0xFF && !readOnly) {
+        id = _nvs_ns_add(name, len);
+        if (id == 0xFF) return false;
+    }
     _readOnly = readOnly;
     _path    = name;
+    _nsId    = id;
     _started = true;
     return true;
 }
 
 void Preferences::end() {
     if (!_started) return;
+    rollback();
+    _cacheUsed = 0;
     _path    = "";
     _started = false;
 }
@@ -226,23 +1090,43 @@ bool Preferences::format() {
 
 #endif
 
+/*
+ * Reclaim space in the background: each step erases a free sector, or moves
+ * the log on to a new sector (collecting the oldest one) once the head is
+ * almost full and that's worth it.
+ * Returns the number of steps done, 0 when there's nothing left to do.
+ * */
+
+size_t Preferences::maintenance(size_t budget) {
+    if (!_nvs_ready || _nvs_old) return 0;
+    size_t steps = 0;
+    while (steps < budget) {
+        uint32_t dirty = SFUD_NVS_SECTORS;
+        for (uint32_t s = (_nvs_last + 1) % SFUD_NVS_SECTORS; s != _nvs_first; s = (s + 1) % SFUD_NVS_SECTORS) {
+            if (!(_nvs_clean & (1u << s))) { dirty = s; break; }
+        }
+        if (dirty < SFUD_NVS_SECTORS) {
+            if (!_nvs_erase_sect(dirty)) break;
+        } else if (_nvs_used() == SFUD_NVS_SECTORS - 1 &&
+                   _sect_end(_nvs_last) - _nvs_head < SFUD_NVS_SECTOR_SIZE / 4 &&
+                   _nvs_dead[_nvs_first] >= SFUD_NVS_SECTOR_SIZE / 8) {
+            LOG_I("collecting sector %u", _nvs_first);
+            if (!_nvs_advance()) break;
+        } else {
+            break;
+        }
+        steps++;
+    }
+    return steps;
+}
+
 bool Preferences::clear() {
     if (!_started || _readOnly) return false;
-    const char* ns     = _path.c_str();
-    uint8_t     ns_len = (uint8_t)_path.length();
-    uint32_t    off    = 0;
-    while (off + sizeof(_NvsHdr) <= (uint32_t)SFUD_NVS_FLASH_SIZE) {
-        _NvsHdr h;
-        sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + off, sizeof(h), (uint8_t*)&h);
-        if (h.magic == 0xFFFFFFFF) break;
-        if (!_hdr_valid(h)) break;
-        if (h.magic == SFUD_NVS_MAGIC && h.ns_len == ns_len) {
-            uint8_t ns_buf[SFUD_NVS_MAX_NAME];
-            sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + off + sizeof(_NvsHdr), ns_len, ns_buf);
-            if (memcmp(ns_buf, ns, ns_len) == 0)
-                _nvs_invalidate(off);
-        }
-        off += _rec_size(h.ns_len, h.key_len, h.val_len);
+    _cacheUsed = 0;
+    _NvsHdr h;
+    for (uint32_t off = _sect_start(_nvs_first); _nvs_next(&off, &h); off += _rec_size(h.key_len, h.val_len)) {
+        if (h.magic == SFUD_NVS_MAGIC && h.ns == _nsId)
+            _nvs_invalidate(off);
     }
     return true;
 }
@@ -250,78 +1134,67 @@ bool Preferences::clear() {
 bool Preferences::remove(const char* key) {
     uint8_t key_len = _nvs_name_len(key);
     if (!_started || _readOnly || !key_len) return false;
-    uint32_t off = _nvs_find(_path.c_str(), (uint8_t)_path.length(), key, key_len);
+    _cacheDrop(key);
+    uint32_t off = _nvs_lookup(_path, &_nsId, key, key_len);
     if (off == 0xFFFFFFFF) return false;
     _nvs_invalidate(off);
     return true;
 }
 
 size_t Preferences::putBytes(const char* key, const void* buf, size_t len) {
-    uint8_t key_len = _nvs_name_len(key);
-    if (!_started || _readOnly || !key_len) return 0;
-    if (!buf && len > 0) return 0;
-    if (len > SFUD_NVS_MAX_VALUE) return 0;
-    const char* ns      = _path.c_str();
-    uint8_t     ns_len  = (uint8_t)_path.length();
-    uint32_t    old     = _nvs_find(ns, ns_len, key, key_len);
-    if (old != 0xFFFFFFFF) {
-        _NvsHdr h;
-        sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + old, sizeof(h), (uint8_t*)&h);
-        if (h.val_len == len) {
-            uint8_t tmp[SFUD_NVS_MAX_VALUE];
-            sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + old + sizeof(h) + ns_len + key_len, len, tmp);
-            if (len == 0 || memcmp(tmp, buf, len) == 0) return len; // unchanged, skip write
-        }
+    if (_inTransaction) {
+        if (!_nvs_name_len(key) || (!buf && len > 0) || len > SFUD_NVS_MAX_VALUE) return 0;
+        return _txnPut(key, buf, len);
     }
-    bool compacted = false;
-    if (!_nvs_append(ns, ns_len, key, key_len, buf, (uint16_t)len, &compacted)) return 0;
-    // If _nvs_append() had to compact, every offset computed before this
-    // call - including `old` - is stale: compaction erases and rewrites
-    // the whole region, relocating live records to new offsets.
-    // Invalidating `old` now would zero out whatever unrelated record now
-    // sits at that offset. The superseded value (still "latest" when
-    // compaction ran, so compaction kept a copy of it) is harmless to
-    // leave behind: it's no longer the latest record for this key - the
-    // one just appended is - so reads already ignore it, and the next
-    // compaction pass will drop it for good.
-    if (old != 0xFFFFFFFF && !compacted) _nvs_invalidate(old);
-    return len;
+    PreferenceEntry entry = { key, buf, len };
+    return (putEntries(&entry, 1) == 1) ? len : 0;
 }
 
-bool Preferences::isKey(const char* key) {
+/*
+ * Put several keys at once, all or nothing (see _nvs_put()).
+ * Returns `count`, or 0 if nothing was stored.
+ * */
+
+size_t Preferences::putEntries(const PreferenceEntry* entries, size_t count) {
+    if (!_started || _readOnly || !entries) return 0;
+    for (size_t i = 0; i < count; i++) _cacheDrop(entries[i].key);
+    return _nvs_put(_nsId, entries, count);
+}
+
+bool Preferences::_isKey(const char* key) {
     uint8_t key_len = _nvs_name_len(key);
     if (!_started || !key_len) return false;
-    return _nvs_find(_path.c_str(), (uint8_t)_path.length(), key, key_len) != 0xFFFFFFFF;
+    return _nvs_lookup(_path, &_nsId, key, key_len) != 0xFFFFFFFF;
 }
 
-size_t Preferences::getBytesLength(const char* key) {
+size_t Preferences::_getBytesLength(const char* key) {
     uint8_t key_len = _nvs_name_len(key);
     if (!_started || !key_len) return 0;
-    uint32_t off = _nvs_find(_path.c_str(), (uint8_t)_path.length(), key, key_len);
+    uint32_t off = _nvs_lookup(_path, &_nsId, key, key_len);
     if (off == 0xFFFFFFFF) return 0;
     _NvsHdr h;
     sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + off, sizeof(h), (uint8_t*)&h);
     return h.val_len;
 }
 
-size_t Preferences::getBytes(const char* key, void* dst, size_t maxLen) {
+size_t Preferences::_getBytes(const char* key, void* dst, size_t maxLen) {
     uint8_t key_len = _nvs_name_len(key);
     if (!_started || !key_len) return 0;
-    uint32_t off = _nvs_find(_path.c_str(), (uint8_t)_path.length(), key, key_len);
+    uint32_t off = _nvs_lookup(_path, &_nsId, key, key_len);
     if (off == 0xFFFFFFFF) return 0;
     _NvsHdr h;
     sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + off, sizeof(h), (uint8_t*)&h);
     if (!dst || !maxLen) return h.val_len;
     if (h.val_len > maxLen) { LOG_W("buffer too small: %u < %u", maxLen, h.val_len); return 0; }
     if (h.val_len > 0)
-        sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + off + sizeof(h) + h.ns_len + h.key_len, h.val_len, (uint8_t*)dst);
+        sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + _val_off(off, h), h.val_len, (uint8_t*)dst);
     return h.val_len;
 }
 
-size_t Preferences::getString(const char* key, char* value, const size_t maxLen) {
+size_t Preferences::_getString(const char* key, char* value, const size_t maxLen) {
     uint8_t key_len = _nvs_name_len(key);
     if (!_started || !value || !maxLen || !key_len) return 0;
-    uint32_t off = _nvs_find(_path.c_str(), (uint8_t)_path.length(), key, key_len);
+    uint32_t off = _nvs_lookup(_path, &_nsId, key, key_len);
     if (off == 0xFFFFFFFF) return 0; // not found, buffer untouched
     _NvsHdr h;
     sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + off, sizeof(h), (uint8_t*)&h);
@@ -330,28 +1203,166 @@ size_t Preferences::getString(const char* key, char* value, const size_t maxLen)
         return 0;
     }
     if (h.val_len > 0)
-        sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + off + sizeof(h) + h.ns_len + h.key_len, h.val_len, (uint8_t*)value);
+        sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + _val_off(off, h), h.val_len, (uint8_t*)value);
     value[h.val_len] = '\0';
     return h.val_len;
 }
 
-String Preferences::getString(const char* key, const String defaultValue) {
+String Preferences::_getString(const char* key, const String defaultValue) {
     uint8_t key_len = _nvs_name_len(key);
     if (!_started || !key_len) return defaultValue;
-    uint32_t off = _nvs_find(_path.c_str(), (uint8_t)_path.length(), key, key_len);
+    uint32_t off = _nvs_lookup(_path, &_nsId, key, key_len);
     if (off == 0xFFFFFFFF) return defaultValue;
     _NvsHdr h;
     sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + off, sizeof(h), (uint8_t*)&h);
     if (h.val_len == 0) return String("");
     char buf[SFUD_NVS_MAX_VALUE + 1];
-    sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + off + sizeof(h) + h.ns_len + h.key_len, h.val_len, (uint8_t*)buf);
+    sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + _val_off(off, h), h.val_len, (uint8_t*)buf);
     buf[h.val_len] = '\0';
     return String(buf);
 }
 
+/*
+ * Iterate over all keys in a single pass over the log. The value buffer is
+ * bounded by SFUD_NVS_MAX_VALUE, which streams can't exceed either.
+ * The callback must not change the storage.
+ * */
+
+size_t Preferences::forEach(PreferenceCallback callback, void* arg) {
+    if (!_started || !callback) return 0;
+    // Records of an old log have the length of their namespace name in `ns`
+    uint8_t ns = _nvs_old ? (uint8_t)_path.length() : _nvs_ns(_path, &_nsId);
+    if (ns == 0xFF) return 0;
+    size_t count = 0;
+    _NvsHdr h;
+    for (uint32_t off = _log_start(); _log_next(&off, &h); off += _log_size(h)) {
+        if (h.magic != SFUD_NVS_MAGIC || h.ns != ns) continue;
+        if (_nvs_old && !_v1_in(off, _path.c_str(), ns)) continue;
+        char key[SFUD_NVS_MAX_NAME + 1];
+        char val[SFUD_NVS_MAX_VALUE];
+        sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + _key_off(off, h), h.key_len, (uint8_t*)key);
+        if (h.val_len) sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + _val_off(off, h), h.val_len, (uint8_t*)val);
+        key[h.key_len] = '\0';
+        count++;
+        if (!callback(key, val, h.val_len, arg)) break;
+    }
+    return count;
+}
+
+/*
+ * Streams: a writer reserves its record at the head, and its value is
+ * programmed as it comes through the staging buffer. close() activates it.
+ * One writer can be open at a time, for values up to SFUD_NVS_MAX_VALUE.
+ * If its sector gets collected meanwhile, the writer fails.
+ * */
+
+size_t Preferences::_readAt(const char* key, size_t offset, void* buf, size_t len) {
+    uint8_t  key_len = _nvs_name_len(key);
+    uint32_t off     = _nvs_lookup(_path, &_nsId, key, key_len);
+    if (off == 0xFFFFFFFF) return 0;
+    _NvsHdr h;
+    sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + off, sizeof(h), (uint8_t*)&h);
+    if (offset >= h.val_len) return 0;
+    if (len > h.val_len - offset) len = h.val_len - offset;
+    sfud_read(_sfud_dev, SFUD_NVS_FLASH_OFFSET + _val_off(off, h) + offset, len, (uint8_t*)buf);
+    return len;
+}
+
+bool Preferences::_writeOpen(PreferenceWriter& w) {
+    uint8_t key_len = _nvs_name_len(w._key);
+    if (!key_len || w._size > SFUD_NVS_MAX_VALUE || _nvs_wr_off != 0xFFFFFFFF) return false;
+    uint32_t sz  = _rec_size(key_len, (uint16_t)w._size);
+    uint32_t old = 0xFFFFFFFF;
+    if (!_nvs_flush() || !_nvs_reserve(sz, _nsId, w._key, key_len, &old)) return false;
+    _NvsHdr  h   = { 0xFFFFFFFF, _nsId, key_len, (uint16_t)w._size };
+    uint32_t off = _nvs_head;
+    _nvs_head = off + sz;
+    if (!_nvs_stage(off, &h, sizeof(h)) || !_nvs_stage(off + sizeof(h), w._key, key_len)) return false;
+    w._off      = off;
+    _nvs_wr_off = off;
+    return true;
+}
+
+bool Preferences::_writeChunk(PreferenceWriter& w, const void* buf, size_t len) {
+    if (_nvs_wr_off != w._off) return false;
+    return _nvs_stage(w._off + sizeof(_NvsHdr) + _nvs_name_len(w._key) + w._pos, buf, len);
+}
+
+bool Preferences::_writeClose(PreferenceWriter& w, bool store) {
+    static const uint8_t pad[3] = { 0xFF, 0xFF, 0xFF };
+    if (_nvs_wr_off != w._off) return false;
+    _nvs_wr_off = 0xFFFFFFFF;
+    uint8_t  key_len = _nvs_name_len(w._key);
+    uint32_t sz      = _rec_size(key_len, (uint16_t)w._size);
+    uint32_t end     = w._off + sizeof(_NvsHdr) + key_len + w._size;
+    if (!store) {
+        _nvs_dead[w._off / SFUD_NVS_SECTOR_SIZE] += sz;
+        return _nvs_flush();
+    }
+    if (!_nvs_stage(end, pad, w._off + sz - end)) return false;
+    return _nvs_commit(w._off, _nvs_find(_nsId, w._key, key_len), _nvs_hash(_nsId, w._key, key_len));
+}
+
+/*
+ * Storage figures, from a single pass over the log. Dead records are the
+ * deleted ones and interrupted writes, until GC reclaims their sector.
+ * */
+
+static uint32_t _nvs_free_bytes() {
+    uint32_t spare = SFUD_NVS_SECTORS - _nvs_used() - 1; // one sector is kept free
+    return _sect_end(_nvs_last) - _nvs_head + spare * (SFUD_NVS_SECTOR_SIZE - sizeof(_NvsSect));
+}
+
+// As accounted for GC, including the garbage left by an interrupted write
+static uint32_t _nvs_dead_bytes() {
+    uint32_t dead = 0;
+    for (uint32_t i = 0, s = _nvs_first; i < _nvs_used(); i++, s = (s + 1) % SFUD_NVS_SECTORS) {
+        dead += _nvs_dead[s];
+    }
+    return dead;
+}
+
+static bool _nvs_count_entry(const char*, const void*, size_t, void*) {
+    return true;
+}
+
+PreferenceStats Preferences::stats() {
+    PreferenceStats st;
+    memset(&st, 0, sizeof(st));
+    if (!_started) return st;
+    if (_nvs_old) {
+        // Read-only, see _nvs_migrate()
+        st.entries     = forEach(_nvs_count_entry, NULL);
+        st.blockSize   = SFUD_NVS_SECTOR_SIZE;
+        st.blocksTotal = SFUD_NVS_SECTORS;
+        st.blocksUsed  = SFUD_NVS_SECTORS;
+        return st;
+    }
+    uint8_t  ns = _nvs_ns(_path, &_nsId);
+    _NvsHdr  h;
+    for (uint32_t off = _sect_start(_nvs_first); _nvs_next(&off, &h); off += _rec_size(h.key_len, h.val_len)) {
+        uint32_t sz = _rec_size(h.key_len, h.val_len);
+        if (off == _nvs_wr_off) continue; // a stream being written
+        if (h.magic == SFUD_NVS_MAGIC && h.ns == ns) {
+            st.entries++;
+            st.bytesUsed += sz;
+        } else if (h.magic != SFUD_NVS_MAGIC && h.magic != SFUD_NVS_NS_MAGIC) {
+            st.deadEntries++;
+        }
+    }
+    uint32_t taken = _nvs_head - _sect_start(_nvs_last) + (_nvs_used() - 1) * (SFUD_NVS_SECTOR_SIZE - sizeof(_NvsSect));
+    st.deadBytes   = _nvs_dead_bytes();
+    st.bytesFree   = _nvs_free_bytes();
+    st.blockSize   = SFUD_NVS_SECTOR_SIZE;
+    st.blocksTotal = SFUD_NVS_SECTORS;
+    st.blocksUsed  = _nvs_used();
+    if (taken) st.fragmentation = (uint64_t)st.deadBytes * 100 / taken;
+    return st;
+}
+
+// Records with a 15-character key and an 8-byte value (32 bytes, like an
+// ESP32 NVS entry), counting the space that GC can reclaim
 size_t Preferences::freeEntries() {
-    if (!_started) return 0;
-    uint32_t used = _nvs_end();
-    uint32_t free_bytes = (used < (uint32_t)SFUD_NVS_FLASH_SIZE) ? (SFUD_NVS_FLASH_SIZE - used) : 0;
-    return free_bytes / (sizeof(_NvsHdr) + 4); // rough estimate
+    if (!_started || _nvs_old) return 0;
+    return (_nvs_free_bytes() + _nvs_dead_bytes()) / _rec_size(15, 8);
 }
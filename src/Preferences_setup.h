@@ -3,6 +3,8 @@
 #define _PREFERENCES_SETUP_H_
 
 //#define NVS_FORMAT_ENABLE
+//#define NVS_PACKED          // Store each namespace in a single file (FS backends only)
+//#define NVS_STATS           // Count the storage I/O, see Preferences::ioStats()
 
 #if defined(NVS_USE_POSIX) || defined(NVS_USE_LITTLEFS) || defined(NVS_USE_SPIFFS) || defined(NVS_USE_DCT) || defined(NVS_USE_SFUD)
   // OK, use it.
@@ -33,6 +35,19 @@
   #error "FS API not implemented for the target platform"
 #endif
 
+#if defined(NVS_PACKED) && (defined(NVS_USE_DCT) || defined(NVS_USE_SFUD))
+  #error "NVS_PACKED is only supported by the FS backends"
+#elif defined(NVS_PACKED) && defined(NVS_USE_POSIX) && defined(__linux__) && !defined(PARTICLE) && !defined(NVS_PACKED_NO_MMAP)
+  #define NVS_PACKED_MMAP     // Read-only objects map the namespace file
+  #if !defined(NVS_PACKED_MMAP_RECHECK_MS)
+    #define NVS_PACKED_MMAP_RECHECK_MS 100  // how often they look for a file replaced by another process
+  #endif
+#endif
+
+#if defined(NVS_USE_POSIX) || defined(NVS_USE_LITTLEFS) || defined(NVS_USE_SFUD)
+  #define NVS_ATOMIC_BATCH    // putEntries() stores all the entries or none, even on power loss
+#endif
+
 #if defined(NVS_USE_DCT)
     extern "C" {
       #include <dct.h>
@@ -9,20 +9,29 @@
   #define FS NVS_FS
   #define _FS_MODE_READ  FILE_READ
   #define _FS_MODE_WRITE FILE_WRITE_BEGIN
+  #define _FS_MODE_APPEND FILE_WRITE
 #elif defined(NVS_LFS_NRF52)
   #include <InternalFileSystem.h>
   using namespace Adafruit_LittleFS_Namespace;
   #define FS InternalFS
   #define _FS_MODE_READ  FILE_O_READ
   #define _FS_MODE_WRITE FILE_O_WRITE
+  #define _FS_MODE_APPEND FILE_O_WRITE  // always seeks to the end
 #else
   #include "LittleFS.h"
   #define FS LittleFS
   #define _FS_MODE_READ  "r"
   #define _FS_MODE_WRITE "w"
+  #define _FS_MODE_APPEND "a"
 #endif
 
-static bool _fs_init() {
+#if defined(LFS_NAME_MAX)
+  #define _FS_NAME_MAX LFS_NAME_MAX
+#else
+  #define _FS_NAME_MAX 255    // LittleFS default
+#endif
+
+static inline bool _fs_init() {
 #if defined(NVS_LFS_TEENSY)
     return FS.begin(NVS_TEENSY_FS_SIZE);
 #else
@@ -32,13 +41,13 @@ static bool _fs_init() {
 
 #ifdef NVS_FORMAT_ENABLE
 
-static bool _fs_format() {
+static inline bool _fs_format() {
     return FS.format();
 }
 
 #endif
 
-static bool _fs_mkdir(const char *path) {
+static inline bool _fs_mkdir(const char *path) {
 #if defined(NVS_LFS_TEENSY) || defined(NVS_LFS_NRF52)
     // Unlike ESP8266/RP2040, paths aren't auto-created here
     if (FS.exists(path)) {
@@ -52,21 +61,22 @@ static bool _fs_mkdir(const char *path) {
 #endif
 }
 
-static bool verifyContent(File& f, const void* buf, size_t bufsize) {
-    // TODO: read in chunks, remove this limitation
-    if (f.size() == bufsize && bufsize <= 1024) {
-        // Check if content is the same
-        uint8_t tmp[bufsize];
-        if ((size_t)f.read((uint8_t*)tmp, bufsize) == bufsize) {
-            if (!memcmp(buf, tmp, bufsize)) {
-                return true;
-            }
+static inline bool verifyContent(File& f, const void* buf, size_t bufsize) {
+    if (f.size() != bufsize) {
+        return false;
+    }
+    // Compare in chunks, so values of any size are checked with a small stack
+    uint8_t tmp[64];
+    for (size_t off = 0; off < bufsize; off += sizeof(tmp)) {
+        size_t n = (bufsize - off < sizeof(tmp)) ? bufsize - off : sizeof(tmp);
+        if ((size_t)f.read(tmp, n) != n || memcmp((const uint8_t*)buf + off, tmp, n)) {
+            return false;
         }
     }
-    return false;
+    return true;
 }
 
-static bool _fs_verify(const char* path, const void* buf, size_t bufsize) {
+static inline bool _fs_verify(const char* path, const void* buf, size_t bufsize) {
     LOG_D("%s %s (%d bytes)", __FUNCTION__, path, bufsize);
     if (File f = FS.open(path, _FS_MODE_READ)) {
         return verifyContent(f, buf, bufsize);
@@ -74,7 +84,7 @@ static bool _fs_verify(const char* path, const void* buf, size_t bufsize) {
     return false;
 }
 
-static int _fs_create(const char* path, const void* buf, size_t bufsize) {
+static inline int _fs_create(const char* path, const void* buf, size_t bufsize) {
     LOG_D("%s %s (%d bytes)", __FUNCTION__, path, bufsize);
     if (File f = FS.open(path, _FS_MODE_WRITE)) {
 #if defined(NVS_LFS_TEENSY) || defined(NVS_LFS_NRF52)
@@ -88,7 +98,7 @@ static int _fs_create(const char* path, const void* buf, size_t bufsize) {
     return -1;
 }
 
-static int _fs_read(const char* path, void* buf, size_t bufsize) {
+static inline int _fs_read(const char* path, void* buf, size_t bufsize) {
     LOG_D("%s %s (%d bytes)", __FUNCTION__, path, bufsize);
     if (File f = FS.open(path, _FS_MODE_READ)) {
         return f.read((uint8_t*)buf, bufsize);
@@ -96,28 +106,108 @@ static int _fs_read(const char* path, void* buf, size_t bufsize) {
     return -1;
 }
 
-static int _fs_get_size(const char* path) {
+static inline int _fs_read_all(const char* path, void* buf, size_t bufsize) {
+    LOG_D("%s %s (%d bytes)", __FUNCTION__, path, bufsize);
+    if (File f = FS.open(path, _FS_MODE_READ)) {
+        int len = f.size();
+        if (len > 0 && (size_t)len <= bufsize && (int)f.read((uint8_t*)buf, len) != len) {
+            return -1;
+        }
+        return len;
+    }
+    return -1;
+}
+
+static inline int _fs_read_at(const char* path, size_t offset, void* buf, size_t bufsize) {
+    LOG_D("%s %s (%d bytes at %d)", __FUNCTION__, path, bufsize, offset);
+    if (File f = FS.open(path, _FS_MODE_READ)) {
+        if (!f.seek(offset)) {
+            return -1;
+        }
+        return f.read((uint8_t*)buf, bufsize);
+    }
+    return -1;
+}
+
+static inline int _fs_append(const char* path, const void* buf, size_t bufsize) {
+    LOG_D("%s %s (%d bytes)", __FUNCTION__, path, bufsize);
+    if (File f = FS.open(path, _FS_MODE_APPEND)) {
+        return f.write((const uint8_t*)buf, bufsize);
+    }
+    return -1;
+}
+
+static inline int _fs_get_size(const char* path) {
     if (File f = FS.open(path, _FS_MODE_READ)) {
         return f.size();
     }
     return -1;
 }
 
-static bool _fs_exists(const char* path) {
+static inline bool _fs_exists(const char* path) {
     return FS.exists(path);
 }
 
-static bool _fs_rename(const char* from, const char* to) {
+static inline bool _fs_rename(const char* from, const char* to) {
     LOG_D("%s %s => %s", __FUNCTION__, from, to);
     return FS.rename(from, to);
 }
 
-static bool _fs_unlink(const char* path) {
+static inline bool _fs_unlink(const char* path) {
     LOG_D("%s %s", __FUNCTION__, path);
     return FS.remove(path);
 }
 
-static bool _fs_clean_dir(const char* path) {
+// Block size and usage of the filesystem
+static inline bool _fs_info(const char* path, size_t* blockSize, size_t* totalBytes, size_t* usedBytes) {
+    (void)path;
+#if defined(NVS_LFS_TEENSY)
+    *blockSize  = 0; // not exposed
+    *totalBytes = FS.totalSize();
+    *usedBytes  = FS.usedSize();
+    return true;
+#elif defined(NVS_LFS_NRF52)
+    // Adafruit_LittleFS doesn't report its usage
+    (void)blockSize; (void)totalBytes; (void)usedBytes;
+    return false;
+#else
+    FSInfo info;
+    if (!FS.info(info)) {
+        return false;
+    }
+    *blockSize  = info.blockSize;
+    *totalBytes = info.totalBytes;
+    *usedBytes  = info.usedBytes;
+    return true;
+#endif
+}
+
+// Calls `cb` with the name of each file in a directory, until it returns false
+static inline bool _fs_list_dir(const char* path, bool (*cb)(const char* name, void* arg), void* arg) {
+#if defined(NVS_LFS_TEENSY) || defined(NVS_LFS_NRF52)
+    File dir = FS.open(path, _FS_MODE_READ);
+    if (!dir) {
+        return false;
+    }
+    while (File f = dir.openNextFile()) {
+        String name = f.name();
+        f.close();
+        if (!cb(name.c_str(), arg)) {
+            break;
+        }
+    }
+#else
+    Dir dir = FS.openDir(path);
+    while (dir.next()) {
+        if (!cb(dir.fileName().c_str(), arg)) {
+            break;
+        }
+    }
+#endif
+    return true;
+}
+
+static inline bool _fs_clean_dir(const char* path) {
     LOG_D("%s %s", __FUNCTION__, path);
 #if defined(NVS_LFS_TEENSY) || defined(NVS_LFS_NRF52)
     // No Dir/openDir() here: directory entries are walked via File::openNextFile()
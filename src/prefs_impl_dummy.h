@@ -1,56 +1,83 @@
+#define _FS_NAME_MAX 255
 
-static bool _fs_init() {
+
+static inline bool _fs_init() {
     return true;
 }
 
-static bool _fs_mkdir(const char *path) {
+static inline bool _fs_mkdir(const char *path) {
     (void)path;
     return true;
 }
 
-static bool _fs_verify(const char* path, const void* buf, size_t bufsize) {
+static inline bool _fs_verify(const char* path, const void* buf, size_t bufsize) {
     (void)path; (void)buf; (void)bufsize;
     return true;
 }
 
-static int _fs_create(const char* path, const void* buf, size_t bufsize) {
+static inline int _fs_create(const char* path, const void* buf, size_t bufsize) {
     (void)path; (void)buf; (void)bufsize;
     return bufsize;
 }
 
-static int _fs_read(const char* path, void* buf, size_t bufsize) {
+static inline int _fs_read(const char* path, void* buf, size_t bufsize) {
+    (void)path; (void)buf; (void)bufsize;
+    return -1;
+}
+
+static inline int _fs_read_all(const char* path, void* buf, size_t bufsize) {
     (void)path; (void)buf; (void)bufsize;
     return -1;
 }
 
-static int _fs_get_size(const char* path) {
+static inline int _fs_read_at(const char* path, size_t offset, void* buf, size_t bufsize) {
+    (void)path; (void)offset; (void)buf; (void)bufsize;
+    return -1;
+}
+
+static inline int _fs_append(const char* path, const void* buf, size_t bufsize) {
+    (void)path; (void)buf;
+    return bufsize;
+}
+
+static inline int _fs_get_size(const char* path) {
     (void)path;
     return -1;
 }
 
-static bool _fs_exists(const char* path) {
+static inline bool _fs_exists(const char* path) {
     (void)path;
     return false;
 }
 
-static bool _fs_rename(const char* from, const char* to) {
+static inline bool _fs_rename(const char* from, const char* to) {
     (void)from; (void)to;
     return true;
 }
 
-static bool _fs_unlink(const char* path) {
+static inline bool _fs_unlink(const char* path) {
     (void)path;
     return true;
 }
 
-static bool _fs_clean_dir(const char* path) {
+static inline bool _fs_info(const char* path, size_t* blockSize, size_t* totalBytes, size_t* usedBytes) {
+    (void)path; (void)blockSize; (void)totalBytes; (void)usedBytes;
+    return false;
+}
+
+static inline bool _fs_list_dir(const char* path, bool (*cb)(const char* name, void* arg), void* arg) {
+    (void)path; (void)cb; (void)arg;
+    return true;
+}
+
+static inline bool _fs_clean_dir(const char* path) {
     (void)path;
     return true;
 }
 
 #ifdef NVS_FORMAT_ENABLE
 
-static bool _fs_format() {
+static inline bool _fs_format() {
     return true;
 }
 
@@ -1,15 +1,23 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <unistd.h>
 
-static bool _fs_init() {
+#if defined(NAME_MAX)
+  #define _FS_NAME_MAX NAME_MAX
+#else
+  #define _FS_NAME_MAX 255
+#endif
+
+static inline bool _fs_init() {
     return true;
 }
 
-static bool _fs_mkdir(const char *path) {
+static inline bool _fs_mkdir(const char *path) {
     struct stat statbuf;
 
     if (stat(path, &statbuf) == 0) {
@@ -38,7 +46,7 @@ static bool _fs_mkdir(const char *path) {
 
 #ifdef NVS_FORMAT_ENABLE
 
-static bool _fs_rmdir_recursive(const String& path) {
+static inline bool _fs_rmdir_recursive(const String& path) {
     DIR* dir = opendir(path.c_str());
     if (!dir) {
         return (errno == ENOENT); // nothing to remove
@@ -72,33 +80,30 @@ static bool _fs_rmdir_recursive(const String& path) {
     return ok;
 }
 
-static bool _fs_format() {
+static inline bool _fs_format() {
     return _fs_rmdir_recursive(NVS_PATH);
 }
 
 #endif
 
-static bool _fs_verify(const char* path, const void* buf, size_t bufsize) {
+static inline bool _fs_verify(const char* path, const void* buf, size_t bufsize) {
     int fd = open(path, O_RDONLY);
-    if (fd >= 0) {
-        struct stat st;
-        stat(path, &st);
-        if (st.st_size == bufsize && bufsize <= 1024) {
-            // Check if content is the same
-            uint8_t tmp[bufsize];
-            if (read(fd, tmp, bufsize) == bufsize) {
-                if (!memcmp(buf, tmp, bufsize)) {
-                    close(fd);
-                    return true;
-                }
-            }
-        }
-        close(fd);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    bool same = (0 == fstat(fd, &st) && (size_t)st.st_size == bufsize);
+    // Compare in chunks, so values of any size are checked with a small stack
+    uint8_t tmp[64];
+    for (size_t off = 0; same && off < bufsize; off += sizeof(tmp)) {
+        size_t n = (bufsize - off < sizeof(tmp)) ? bufsize - off : sizeof(tmp);
+        same = (read(fd, tmp, n) == (ssize_t)n) && !memcmp((const uint8_t*)buf + off, tmp, n);
     }
-    return false;
+    close(fd);
+    return same;
 }
 
-static int _fs_create(const char* path, const void* buf, size_t bufsize) {
+static inline int _fs_create(const char* path, const void* buf, size_t bufsize) {
     int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
     if (fd == -1) {
         return -1;
@@ -108,7 +113,7 @@ static int _fs_create(const char* path, const void* buf, size_t bufsize) {
     return len;
 }
 
-static int _fs_read(const char* path, void* buf, size_t bufsize) {
+static inline int _fs_read(const char* path, void* buf, size_t bufsize) {
     int fd = open(path, O_RDONLY);
     if (fd == -1) {
         return -1;
@@ -118,7 +123,46 @@ static int _fs_read(const char* path, void* buf, size_t bufsize) {
     return len;
 }
 
-static int _fs_get_size(const char* path) {
+// Reads the whole file with a single open(), if it fits in the buffer.
+// Returns the file size either way, or -1 on error.
+static inline int _fs_read_all(const char* path, void* buf, size_t bufsize) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    int len = -1;
+    if (0 == fstat(fd, &st)) {
+        len = st.st_size;
+        if (len > 0 && (size_t)len <= bufsize && read(fd, buf, len) != len) {
+            len = -1;
+        }
+    }
+    close(fd);
+    return len;
+}
+
+static inline int _fs_read_at(const char* path, size_t offset, void* buf, size_t bufsize) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    int len = pread(fd, buf, bufsize, offset);
+    close(fd);
+    return len;
+}
+
+static inline int _fs_append(const char* path, const void* buf, size_t bufsize) {
+    int fd = open(path, O_WRONLY | O_APPEND);
+    if (fd == -1) {
+        return -1;
+    }
+    int len = write(fd, buf, bufsize);
+    close(fd);
+    return len;
+}
+
+static inline int _fs_get_size(const char* path) {
     struct stat st;
     if (0 == stat(path, &st)) {
         return st.st_size;
@@ -126,20 +170,57 @@ static int _fs_get_size(const char* path) {
     return -1;
 }
 
-static bool _fs_exists(const char* path) {
+static inline bool _fs_exists(const char* path) {
     struct stat st;
     return (0 == stat(path, &st));
 }
 
-static bool _fs_rename(const char* from, const char* to) {
+static inline bool _fs_rename(const char* from, const char* to) {
     return (0 == rename(from, to));
 }
 
-static bool _fs_unlink(const char* path) {
+static inline bool _fs_unlink(const char* path) {
     return (0 == unlink(path));
 }
 
-static bool _fs_clean_dir(const char* path) {
+// Block size and usage of the filesystem holding `path`
+static inline bool _fs_info(const char* path, size_t* blockSize, size_t* totalBytes, size_t* usedBytes) {
+    struct statvfs st;
+    if (0 != statvfs(path, &st)) {
+        return false;
+    }
+    *blockSize  = st.f_frsize;
+    *totalBytes = (size_t)st.f_blocks * st.f_frsize;
+    // Blocks reserved for root aren't available to us: count them as used
+    *usedBytes  = (size_t)(st.f_blocks - st.f_bavail) * st.f_frsize;
+    return true;
+}
+
+// Calls `cb` with the name of each file in a directory, until it returns false
+static inline bool _fs_list_dir(const char* path, bool (*cb)(const char* name, void* arg), void* arg) {
+    DIR* dir = opendir(path);
+    if (!dir) return false;
+
+    struct dirent entry;
+    struct dirent *result;
+
+    for (int ret = readdir_r(dir, &entry, &result);
+         result != NULL && ret == 0;
+         ret = readdir_r(dir, &entry, &result))
+    {
+        const char* name = entry.d_name;
+        if (!strcmp(name, ".") || !strcmp(name, "..")) {
+            continue;
+        }
+        if (!cb(name, arg)) {
+            break;
+        }
+    }
+    closedir(dir);
+    return true;
+}
+
+static inline bool _fs_clean_dir(const char* path) {
     DIR* dir = opendir(path);
     if (!dir) return false;
 
@@ -3,8 +3,18 @@
 #define FS SPIFFS
 #define _FS_MODE_READ  "r"
 #define _FS_MODE_WRITE "w"
+#define _FS_MODE_APPEND "a"
 
-static bool _fs_init() {
+// SPIFFS has no directories, it limits the whole path (including the NUL)
+#if defined(SPIFFS_OBJ_NAME_LEN)
+  #define _FS_PATH_MAX (SPIFFS_OBJ_NAME_LEN - 1)
+#elif defined(CONFIG_SPIFFS_OBJ_NAME_LEN)
+  #define _FS_PATH_MAX (CONFIG_SPIFFS_OBJ_NAME_LEN - 1)
+#else
+  #define _FS_PATH_MAX 31
+#endif
+
+static inline bool _fs_init() {
     bool res = FS.begin();
     // Increase reliability for SPIFFS
     FS.check();
@@ -13,33 +23,34 @@ static bool _fs_init() {
 
 #ifdef NVS_FORMAT_ENABLE
 
-static bool _fs_format() {
+static inline bool _fs_format() {
     return FS.format();
 }
 
 #endif
 
-static bool _fs_mkdir(const char *path) {
+static inline bool _fs_mkdir(const char *path) {
     // Paths are automatically created as needed
     (void)path;
     return true;
 }
 
-static bool verifyContent(File& f, const void* buf, size_t bufsize) {
-    // TODO: read in chunks, remove this limitation
-    if (f.size() == bufsize && bufsize <= 1024) {
-        // Check if content is the same
-        uint8_t tmp[bufsize];
-        if ((size_t)f.read((uint8_t*)tmp, bufsize) == bufsize) {
-            if (!memcmp(buf, tmp, bufsize)) {
-                return true;
-            }
+static inline bool verifyContent(File& f, const void* buf, size_t bufsize) {
+    if (f.size() != bufsize) {
+        return false;
+    }
+    // Compare in chunks, so values of any size are checked with a small stack
+    uint8_t tmp[64];
+    for (size_t off = 0; off < bufsize; off += sizeof(tmp)) {
+        size_t n = (bufsize - off < sizeof(tmp)) ? bufsize - off : sizeof(tmp);
+        if ((size_t)f.read(tmp, n) != n || memcmp((const uint8_t*)buf + off, tmp, n)) {
+            return false;
         }
     }
-    return false;
+    return true;
 }
 
-static int _fs_create(const char* path, const void* buf, size_t bufsize) {
+static inline int _fs_create(const char* path, const void* buf, size_t bufsize) {
     LOG_D("%s %s (%d bytes)", __FUNCTION__, path, bufsize);
     if (File f = FS.open(path, _FS_MODE_WRITE)) {
         return f.write((const uint8_t*)buf, bufsize);
@@ -47,7 +58,7 @@ static int _fs_create(const char* path, const void* buf, size_t bufsize) {
     return -1;
 }
 
-static int _fs_update(const char* path, const void* buf, size_t bufsize) {
+static inline int _fs_update(const char* path, const void* buf, size_t bufsize) {
     if (File f = FS.open(path, "r+")) {
         if (verifyContent(f, buf, bufsize)) {
             LOG_I("data matches, skip writing to %s", path);
@@ -61,31 +72,88 @@ static int _fs_update(const char* path, const void* buf, size_t bufsize) {
     return _fs_create(path, buf, bufsize);
 }
 
-static int _fs_read(const char* path, void* buf, size_t bufsize) {
+static inline int _fs_read(const char* path, void* buf, size_t bufsize) {
+    LOG_D("%s %s (%d bytes)", __FUNCTION__, path, bufsize);
+    if (File f = FS.open(path, _FS_MODE_READ)) {
+        return f.read((uint8_t*)buf, bufsize);
+    }
+    return -1;
+}
+
+static inline int _fs_read_all(const char* path, void* buf, size_t bufsize) {
     LOG_D("%s %s (%d bytes)", __FUNCTION__, path, bufsize);
     if (File f = FS.open(path, _FS_MODE_READ)) {
+        int len = f.size();
+        if (len > 0 && (size_t)len <= bufsize && (int)f.read((uint8_t*)buf, len) != len) {
+            return -1;
+        }
+        return len;
+    }
+    return -1;
+}
+
+static inline int _fs_read_at(const char* path, size_t offset, void* buf, size_t bufsize) {
+    LOG_D("%s %s (%d bytes at %d)", __FUNCTION__, path, bufsize, offset);
+    if (File f = FS.open(path, _FS_MODE_READ)) {
+        if (!f.seek(offset)) {
+            return -1;
+        }
         return f.read((uint8_t*)buf, bufsize);
     }
     return -1;
 }
 
-static int _fs_get_size(const char* path) {
+static inline int _fs_append(const char* path, const void* buf, size_t bufsize) {
+    LOG_D("%s %s (%d bytes)", __FUNCTION__, path, bufsize);
+    if (File f = FS.open(path, _FS_MODE_APPEND)) {
+        return f.write((const uint8_t*)buf, bufsize);
+    }
+    return -1;
+}
+
+static inline int _fs_get_size(const char* path) {
     if (File f = FS.open(path, _FS_MODE_READ)) {
         return f.size();
     }
     return -1;
 }
 
-static bool _fs_exists(const char* path) {
+static inline bool _fs_exists(const char* path) {
     return FS.exists(path);
 }
 
-static bool _fs_unlink(const char* path) {
+static inline bool _fs_unlink(const char* path) {
     LOG_D("%s %s", __FUNCTION__, path);
     return FS.remove(path);
 }
 
-static bool _fs_clean_dir(const char* path) {
+// Block size and usage of the filesystem
+static inline bool _fs_info(const char* path, size_t* blockSize, size_t* totalBytes, size_t* usedBytes) {
+    (void)path;
+    FSInfo info;
+    if (!FS.info(info)) {
+        return false;
+    }
+    *blockSize  = info.blockSize;
+    *totalBytes = info.totalBytes;
+    *usedBytes  = info.usedBytes;
+    return true;
+}
+
+// Calls `cb` with the name of each file in a directory, until it returns false
+static inline bool _fs_list_dir(const char* path, bool (*cb)(const char* name, void* arg), void* arg) {
+    size_t len = strlen(path);
+    Dir dir = FS.openDir(path);
+    while (dir.next()) {
+        String name = dir.fileName(); // SPIFFS has no directories, this is the full path
+        if (name.length() > len && !cb(name.c_str() + len, arg)) {
+            break;
+        }
+    }
+    return true;
+}
+
+static inline bool _fs_clean_dir(const char* path) {
     LOG_D("%s %s", __FUNCTION__, path);
     Dir dir = FS.openDir(path);
     while (dir.next()) {
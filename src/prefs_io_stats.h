@@ -0,0 +1,277 @@
+/*
+ * I/O instrumentation (NVS_STATS): each storage primitive of the backend is
+ * replaced by a wrapper of the same name, which counts its calls, bytes and
+ * time into gPrefsIoStats (see Preferences::ioStats()).
+ *
+ * Included by the backends right after their storage layer, so everything
+ * below it goes through the wrappers.
+ */
+
+#if !defined(ARDUINO) && !defined(PARTICLE)
+  #include <time.h>
+#endif
+
+static PreferenceIoStats gPrefsIoStats;
+
+static inline uint32_t _io_micros() {
+#if defined(ARDUINO) || defined(PARTICLE)
+    return micros();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000000ull + ts.tv_nsec / 1000);
+#endif
+}
+
+// Counts a call into `c`, and the time until it goes out of scope
+class _IoScope {
+    public:
+        explicit _IoScope(PreferenceIoCounter& c) : _c(c), _t0(_io_micros()) { _c.calls++; }
+        ~_IoScope() { _c.micros += (uint32_t)(_io_micros() - _t0); }
+
+        void add(size_t bytes) { _c.bytes += bytes; }
+        int result(int len) { if (len > 0) add(len); return len; }
+
+        // Leave out the time of work counted elsewhere
+        void pause()  { _c.micros += (uint32_t)(_io_micros() - _t0); }
+        void resume() { _t0 = _io_micros(); }
+    private:
+        PreferenceIoCounter& _c;
+        uint32_t             _t0;
+};
+
+#if defined(NVS_USE_SFUD)
+
+static inline sfud_err _io_sfud_read(const sfud_flash* flash, uint32_t addr, size_t size, uint8_t* data) {
+    _IoScope io(gPrefsIoStats.read);
+    sfud_err err = sfud_read(flash, addr, size, data);
+    if (err == SFUD_SUCCESS) io.add(size);
+    return err;
+}
+
+static inline sfud_err _io_sfud_write(const sfud_flash* flash, uint32_t addr, size_t size, const uint8_t* data) {
+    _IoScope io(gPrefsIoStats.write);
+    sfud_err err = sfud_write(flash, addr, size, data);
+    if (err == SFUD_SUCCESS) io.add(size);
+    return err;
+}
+
+static inline sfud_err _io_sfud_erase(const sfud_flash* flash, uint32_t addr, size_t size) {
+    _IoScope io(gPrefsIoStats.erase);
+    sfud_err err = sfud_erase(flash, addr, size);
+    if (err == SFUD_SUCCESS) io.add(size);
+    return err;
+}
+
+#define sfud_read   _io_sfud_read
+#define sfud_write  _io_sfud_write
+#define sfud_erase  _io_sfud_erase
+
+#elif defined(NVS_USE_DCT)
+
+static inline int32_t _io_dct_init(uint32_t begin_address, uint16_t module_number,
+                                   uint16_t variable_name_size, uint16_t variable_value_size,
+                                   uint8_t enable_backup, uint8_t enable_wear_leveling) {
+    _IoScope io(gPrefsIoStats.meta);
+    return dct_init(begin_address, module_number, variable_name_size, variable_value_size,
+                    enable_backup, enable_wear_leveling);
+}
+
+static inline int32_t _io_dct_register_module(char* module_name) {
+    _IoScope io(gPrefsIoStats.meta);
+    return dct_register_module(module_name);
+}
+
+static inline int32_t _io_dct_unregister_module(char* module_name) {
+    _IoScope io(gPrefsIoStats.erase);
+    return dct_unregister_module(module_name);
+}
+
+static inline int32_t _io_dct_open_module(dct_handle_t* dct_handle, char* module_name) {
+    _IoScope io(gPrefsIoStats.meta);
+    return dct_open_module(dct_handle, module_name);
+}
+
+static inline int32_t _io_dct_close_module(dct_handle_t* dct_handle) {
+    _IoScope io(gPrefsIoStats.meta);
+    return dct_close_module(dct_handle);
+}
+
+static inline int32_t _io_dct_set_variable_new(dct_handle_t* dct_handle, char* variable_name,
+                                               char* variable_value, uint16_t variable_value_length) {
+    _IoScope io(gPrefsIoStats.write);
+    int32_t ret = dct_set_variable_new(dct_handle, variable_name, variable_value, variable_value_length);
+    if (ret == DCT_SUCCESS) io.add(variable_value_length);
+    return ret;
+}
+
+static inline int32_t _io_dct_get_variable_new(dct_handle_t* dct_handle, char* variable_name,
+                                               char* buffer, uint16_t* buffer_size) {
+    _IoScope io(gPrefsIoStats.read);
+    int32_t ret = dct_get_variable_new(dct_handle, variable_name, buffer, buffer_size);
+    if (ret == DCT_SUCCESS) io.add(*buffer_size);
+    return ret;
+}
+
+static inline int32_t _io_dct_delete_variable_new(dct_handle_t* dct_handle, char* variable_name) {
+    _IoScope io(gPrefsIoStats.erase);
+    return dct_delete_variable_new(dct_handle, variable_name);
+}
+
+static inline int32_t _io_dct_remain_variable(dct_handle_t* dct_handle) {
+    _IoScope io(gPrefsIoStats.meta);
+    return dct_remain_variable(dct_handle);
+}
+
+static inline uint16_t _io_dct_get_variable_num(dct_handle_t* dct_handle) {
+    _IoScope io(gPrefsIoStats.meta);
+    return dct_get_variable_num(dct_handle);
+}
+
+static inline int32_t _io_dct_get_variable_name(dct_handle_t* dct_handle, uint16_t index, uint8_t* variable_name) {
+    _IoScope io(gPrefsIoStats.meta);
+    return dct_get_variable_name(dct_handle, index, variable_name);
+}
+
+#define dct_init                _io_dct_init
+#define dct_register_module     _io_dct_register_module
+#define dct_unregister_module   _io_dct_unregister_module
+#define dct_open_module         _io_dct_open_module
+#define dct_close_module        _io_dct_close_module
+#define dct_set_variable_new    _io_dct_set_variable_new
+#define dct_get_variable_new    _io_dct_get_variable_new
+#define dct_delete_variable_new _io_dct_delete_variable_new
+#define dct_remain_variable     _io_dct_remain_variable
+#define dct_get_variable_num    _io_dct_get_variable_num
+#define dct_get_variable_name   _io_dct_get_variable_name
+
+#else // the _fs_* primitives
+
+static inline bool _io_fs_init() {
+    _IoScope io(gPrefsIoStats.meta);
+    return _fs_init();
+}
+
+#ifdef NVS_FORMAT_ENABLE
+static inline bool _io_fs_format() {
+    _IoScope io(gPrefsIoStats.erase);
+    return _fs_format();
+}
+#define _fs_format      _io_fs_format
+#endif
+
+static inline bool _io_fs_mkdir(const char* path) {
+    _IoScope io(gPrefsIoStats.meta);
+    return _fs_mkdir(path);
+}
+
+static inline int _io_fs_create(const char* path, const void* buf, size_t bufsize) {
+    _IoScope io(gPrefsIoStats.write);
+    return io.result(_fs_create(path, buf, bufsize));
+}
+
+#if defined(NVS_USE_SPIFFS)
+static inline int _io_fs_update(const char* path, const void* buf, size_t bufsize) {
+    _IoScope io(gPrefsIoStats.write);
+    return io.result(_fs_update(path, buf, bufsize));
+}
+#define _fs_update      _io_fs_update
+#else
+static inline bool _io_fs_verify(const char* path, const void* buf, size_t bufsize) {
+    _IoScope io(gPrefsIoStats.read);
+    bool same = _fs_verify(path, buf, bufsize);
+    if (same) io.add(bufsize);
+    return same;
+}
+
+static inline bool _io_fs_rename(const char* from, const char* to) {
+    _IoScope io(gPrefsIoStats.meta);
+    return _fs_rename(from, to);
+}
+#define _fs_verify      _io_fs_verify
+#define _fs_rename      _io_fs_rename
+#endif
+
+static inline int _io_fs_read(const char* path, void* buf, size_t bufsize) {
+    _IoScope io(gPrefsIoStats.read);
+    return io.result(_fs_read(path, buf, bufsize));
+}
+
+static inline int _io_fs_read_all(const char* path, void* buf, size_t bufsize) {
+    _IoScope io(gPrefsIoStats.read);
+    int len = _fs_read_all(path, buf, bufsize);
+    if (len > 0 && (size_t)len <= bufsize) io.add(len); // else only its size was read
+    return len;
+}
+
+static inline int _io_fs_read_at(const char* path, size_t offset, void* buf, size_t bufsize) {
+    _IoScope io(gPrefsIoStats.read);
+    return io.result(_fs_read_at(path, offset, buf, bufsize));
+}
+
+static inline int _io_fs_append(const char* path, const void* buf, size_t bufsize) {
+    _IoScope io(gPrefsIoStats.write);
+    return io.result(_fs_append(path, buf, bufsize));
+}
+
+static inline int _io_fs_get_size(const char* path) {
+    _IoScope io(gPrefsIoStats.meta);
+    return _fs_get_size(path);
+}
+
+static inline bool _io_fs_exists(const char* path) {
+    _IoScope io(gPrefsIoStats.meta);
+    return _fs_exists(path);
+}
+
+static inline bool _io_fs_unlink(const char* path) {
+    _IoScope io(gPrefsIoStats.erase);
+    return _fs_unlink(path);
+}
+
+static inline bool _io_fs_info(const char* path, size_t* blockSize, size_t* totalBytes, size_t* usedBytes) {
+    _IoScope io(gPrefsIoStats.meta);
+    return _fs_info(path, blockSize, totalBytes, usedBytes);
+}
+
+// The time of a listing leaves out its callback, whose own I/O is counted by itself
+struct _IoListDir {
+    _IoScope* io;
+    bool    (*cb)(const char* name, void* arg);
+    void*     arg;
+};
+
+static bool _io_list_dir_entry(const char* name, void* arg) {
+    _IoListDir* ctx = (_IoListDir*)arg;
+    ctx->io->pause();
+    bool more = ctx->cb(name, ctx->arg);
+    ctx->io->resume();
+    return more;
+}
+
+static inline bool _io_fs_list_dir(const char* path, bool (*cb)(const char* name, void* arg), void* arg) {
+    _IoScope io(gPrefsIoStats.meta);
+    _IoListDir ctx = { &io, cb, arg };
+    return _fs_list_dir(path, _io_list_dir_entry, &ctx);
+}
+
+static inline bool _io_fs_clean_dir(const char* path) {
+    _IoScope io(gPrefsIoStats.erase);
+    return _fs_clean_dir(path);
+}
+
+#define _fs_init        _io_fs_init
+#define _fs_mkdir       _io_fs_mkdir
+#define _fs_create      _io_fs_create
+#define _fs_read        _io_fs_read
+#define _fs_read_all    _io_fs_read_all
+#define _fs_read_at     _io_fs_read_at
+#define _fs_append      _io_fs_append
+#define _fs_get_size    _io_fs_get_size
+#define _fs_exists      _io_fs_exists
+#define _fs_unlink      _io_fs_unlink
+#define _fs_info        _io_fs_info
+#define _fs_list_dir    _io_fs_list_dir
+#define _fs_clean_dir   _io_fs_clean_dir
+
+#endif
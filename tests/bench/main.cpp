@@ -0,0 +1,222 @@
+/*
+ * Microbenchmarks of the Preferences API, for the backend selected by the
+ * env (see the bench-* envs in platformio.ini):
+ *
+ *   pio run -e bench-posix -t exec > posix.json
+ *
+ * Each operation is measured for 1 to 1000 keys and values of 1B to 4KB,
+ * and printed as JSON: host time per operation, and with the simulated
+ * SFUD flash or DCT (sim/), the flash work and simulated time as well.
+ * Cases the backend can't store (too many keys, values too large) are
+ * listed as skipped.
+ */
+
+#include <Preferences.h>
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(NVS_USE_SFUD)
+  #define BENCH_BACKEND "sfud"
+#elif defined(NVS_USE_DCT)
+  #define BENCH_BACKEND "dct"
+#elif defined(NVS_USE_DUMMY)
+  #define BENCH_BACKEND "dummy"
+#elif defined(NVS_PACKED)
+  #define BENCH_BACKEND "posix-packed"
+#else
+  #define BENCH_BACKEND "posix"
+#endif
+
+static const size_t KEY_COUNTS[]  = { 1, 10, 100, 1000 };
+static const size_t VALUE_SIZES[] = { 1, 32, 1024, 4096 };
+static const size_t MIN_OPS       = 1000; // small cases are repeated up to this
+
+/*
+ * Flash work done by the simulators
+ * */
+
+struct FlashCounters {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t erases;
+    uint64_t timeNs;
+};
+
+static FlashCounters flash_counters() {
+    FlashCounters c;
+    memset(&c, 0, sizeof(c));
+#if defined(NVS_USE_SFUD)
+    SfudSimCounters s = sfud_sim_counters();
+    c.reads  = s.reads;
+    c.writes = s.pages;
+    c.erases = s.erases;
+    c.timeNs = s.timeNs;
+#elif defined(NVS_USE_DCT)
+    DctSimCounters s = dct_sim_counters();
+    c.reads  = s.gets + s.lookups;
+    c.writes = s.sets + s.deletes;
+    c.erases = s.erases;
+    c.timeNs = s.timeNs;
+#endif
+    return c;
+}
+
+/*
+ * A measured operation
+ * */
+
+typedef std::chrono::steady_clock Clock;
+
+struct Measure {
+    uint64_t          ops;
+    uint64_t          hostNs;
+    FlashCounters     flash;
+    Clock::time_point t0;
+    FlashCounters     f0;
+
+    void start() {
+        f0 = flash_counters();
+        t0 = Clock::now();
+    }
+    void stop(uint64_t count) {
+        hostNs += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - t0).count();
+        FlashCounters f = flash_counters();
+        flash.reads  += f.reads - f0.reads;
+        flash.writes += f.writes - f0.writes;
+        flash.erases += f.erases - f0.erases;
+        flash.timeNs += f.timeNs - f0.timeNs;
+        ops += count;
+    }
+};
+
+static bool gFirstResult = true;
+
+static void print_result(const char* op, size_t keys, size_t size, const Measure& m) {
+    printf("%s\n    {\"op\": \"%s\", \"keys\": %u, \"value_size\": %u, \"ops\": %llu, "
+           "\"ns_per_op\": %.1f, \"ops_per_sec\": %.0f",
+           gFirstResult ? "" : ",", op, (unsigned)keys, (unsigned)size, (unsigned long long)m.ops,
+           (double)m.hostNs / m.ops, m.hostNs ? m.ops * 1e9 / m.hostNs : 0.0);
+#if defined(NVS_USE_SFUD) || defined(NVS_USE_DCT)
+    printf(", \"sim_ns_per_op\": %.1f, \"reads_per_op\": %.2f, \"writes_per_op\": %.2f, \"erases_per_op\": %.3f",
+           (double)m.flash.timeNs / m.ops, (double)m.flash.reads / m.ops,
+           (double)m.flash.writes / m.ops, (double)m.flash.erases / m.ops);
+#endif
+    printf("}");
+    gFirstResult = false;
+}
+
+static void print_skipped(size_t keys, size_t size) {
+    printf("%s\n    {\"keys\": %u, \"value_size\": %u, \"skipped\": true}",
+           gFirstResult ? "" : ",", (unsigned)keys, (unsigned)size);
+    gFirstResult = false;
+}
+
+/*
+ * The benchmark
+ * */
+
+static uint8_t gValue[4096];
+
+static void key_name(char* key, size_t i) {
+    snprintf(key, 16, "key%u", (unsigned)i);
+}
+
+// Writes `keys` values of `size` bytes, with a different content for each `seed`
+static bool fill(Preferences& prefs, size_t keys, size_t size, uint8_t seed, Measure& m) {
+    char key[16];
+    memset(gValue, seed, size);
+    for (size_t i = 0; i < keys; i++) {
+        key_name(key, i);
+        m.start();
+        size_t n = prefs.putBytes(key, gValue, size);
+        m.stop(1);
+        if (n != size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void run_case(size_t keys, size_t size) {
+    Measure putNew      = Measure();
+    Measure putSame     = Measure();
+    Measure putChanged  = Measure();
+    Measure getHit      = Measure();
+    Measure getMiss     = Measure();
+    Measure maintenance = Measure();
+    Measure clear       = Measure();
+    Measure begin       = Measure();
+    size_t  rounds      = (keys < MIN_OPS) ? MIN_OPS / keys : 1;
+    char    key[16];
+    static uint8_t buf[4096];
+
+    Preferences prefs;
+    prefs.begin("bench");
+    prefs.clear();
+
+    for (size_t r = 0; r < rounds; r++) {
+        if (!fill(prefs, keys, size, 1, putNew)) {
+            prefs.clear();
+            prefs.end();
+            print_skipped(keys, size);
+            return;
+        }
+        fill(prefs, keys, size, 1, putSame);
+        fill(prefs, keys, size, 2, putChanged);
+        maintenance.start();
+        Preferences::maintenance(1);
+        maintenance.stop(1);
+        for (size_t i = 0; i < keys; i++) {
+            key_name(key, i);
+            getHit.start();
+            prefs.getBytes(key, buf, sizeof(buf));
+            getHit.stop(1);
+        }
+        for (size_t i = 0; i < keys; i++) {
+            key_name(key, keys + i);
+            getMiss.start();
+            prefs.getBytes(key, buf, sizeof(buf));
+            getMiss.stop(1);
+        }
+        {
+            Preferences other;
+            begin.start();
+            other.begin("bench", true);
+            begin.stop(1);
+            other.end();
+        }
+        clear.start();
+        prefs.clear();
+        clear.stop(1);
+    }
+    prefs.end();
+
+    print_result("put_new", keys, size, putNew);
+    print_result("put_same", keys, size, putSame);
+    print_result("put_changed", keys, size, putChanged);
+    print_result("get_hit", keys, size, getHit);
+    print_result("get_miss", keys, size, getMiss);
+    print_result("maintenance", keys, size, maintenance);
+    print_result("begin", keys, size, begin);
+    print_result("clear", keys, size, clear);
+}
+
+int main() {
+    printf("{\n  \"backend\": \"%s\",\n  \"results\": [", BENCH_BACKEND);
+    for (size_t k = 0; k < sizeof(KEY_COUNTS) / sizeof(KEY_COUNTS[0]); k++) {
+        for (size_t s = 0; s < sizeof(VALUE_SIZES) / sizeof(VALUE_SIZES[0]); s++) {
+            run_case(KEY_COUNTS[k], VALUE_SIZES[s]);
+        }
+    }
+    printf("\n  ]\n}\n");
+
+#if defined(NVS_USE_SFUD)
+    if (sfud_sim_counters().badWrites) {
+        fprintf(stderr, "ERROR: %u flash writes tried to set bits without an erase\n",
+                sfud_sim_counters().badWrites);
+        return 1;
+    }
+#endif
+    return 0;
+}
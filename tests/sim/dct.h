@@ -0,0 +1,362 @@
+/*
+ * In-memory stand-in for the Ameba DCT API, so the DCT backend builds and
+ * runs on the host (see the native-dct env in platformio.ini).
+ *
+ * Like the real one, each module holds a fixed number of variables in a 4KB
+ * flash sector, with the name and value size limits given to dct_init().
+ * Every change rewrites the module (and its backup, if enabled).
+ *
+ * Every call is counted, along with the flash work it implies and a
+ * simulated time, based on typical NOR flash timings.
+ */
+
+#ifndef DCT_SIM_H
+#define DCT_SIM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define DCT_SUCCESS          0
+#define DCT_ERR             -1
+#define DCT_ERR_CRC         -2
+#define DCT_ERR_NO_SPACE    -3
+#define DCT_ERR_NO_MEMORY   -4
+#define DCT_ERR_FLASH_RW    -5
+#define DCT_ERR_NOT_FIND    -6
+#define DCT_ERR_INVALID     -7
+#define DCT_ERR_SIZE_OVER   -8
+#define DCT_ERR_MODULE_BUSY -9
+
+#define MODULE_NAME_SIZE     32
+
+#ifndef DCT_SIM_MAX_MODULES
+  #define DCT_SIM_MAX_MODULES  16
+#endif
+#define DCT_SIM_MODULE_SIZE    4096
+#define DCT_SIM_MODULE_HEADER  72       // leaves 4024 bytes for variables
+#ifndef DCT_SIM_MAX_VARIABLES
+  #define DCT_SIM_MAX_VARIABLES  64     // per module, whatever the sizes
+#endif
+
+// Simulated timings, in nanoseconds
+#ifndef DCT_SIM_READ_NS
+  #define DCT_SIM_READ_NS      50       // per byte, memory-mapped flash
+#endif
+#ifndef DCT_SIM_PROGRAM_NS
+  #define DCT_SIM_PROGRAM_NS   700000   // per 256-byte page
+#endif
+#ifndef DCT_SIM_ERASE_NS
+  #define DCT_SIM_ERASE_NS     45000000 // per sector
+#endif
+
+typedef struct {
+    char     module_name[MODULE_NAME_SIZE+1];
+    int32_t  module_index;
+} dct_handle_t;
+
+struct DctSimCounters {
+    uint32_t calls;         // all dct_* calls
+    uint32_t gets;
+    uint32_t sets;
+    uint32_t deletes;
+    uint32_t lookups;       // dct_get_variable_num/name
+    uint32_t modules;       // register, unregister, open, close
+    uint32_t erases;        // sectors erased
+    uint64_t bytesRead;
+    uint64_t bytesWritten;
+    uint64_t timeNs;        // simulated time spent in the flash
+};
+
+struct DctSimVariable {
+    bool     used;
+    uint16_t length;
+    char     name[64];
+    uint8_t  value[1024];
+};
+
+struct DctSimModule {
+    bool           used;
+    char           name[MODULE_NAME_SIZE+1];
+    DctSimVariable var[DCT_SIM_MAX_VARIABLES];
+};
+
+struct DctSim {
+    bool            ready;
+    uint16_t        moduleNumber;
+    uint16_t        nameSize;
+    uint16_t        valueSize;
+    uint16_t        capacity;   // variables per module
+    uint8_t         copies;     // module writes per change (1 + backup)
+    DctSimModule    module[DCT_SIM_MAX_MODULES];
+    DctSimCounters  count;
+};
+
+inline DctSim& dct_sim() {
+    static DctSim sim;
+    return sim;
+}
+
+// Swaps in blank flash. Call it before the first Preferences::begin().
+inline void dct_sim_reset() {
+    memset(&dct_sim(), 0, sizeof(DctSim));
+}
+
+inline DctSimCounters dct_sim_counters() {
+    return dct_sim().count;
+}
+
+inline void dct_sim_reset_counters() {
+    memset(&dct_sim().count, 0, sizeof(DctSimCounters));
+}
+
+// Reading `n` bytes of a module
+inline void dct_sim_read(size_t n) {
+    DctSim& sim = dct_sim();
+    sim.count.bytesRead += n;
+    sim.count.timeNs    += n * DCT_SIM_READ_NS;
+}
+
+// Rewriting a module: an erase and a program of the whole sector, per copy
+inline void dct_sim_rewrite() {
+    DctSim& sim = dct_sim();
+    sim.count.erases       += sim.copies;
+    sim.count.bytesWritten += sim.copies * DCT_SIM_MODULE_SIZE;
+    sim.count.timeNs       += sim.copies * (DCT_SIM_ERASE_NS + DCT_SIM_MODULE_SIZE / 256 * DCT_SIM_PROGRAM_NS);
+}
+
+inline DctSimModule* dct_sim_module(const dct_handle_t* handle) {
+    DctSim& sim = dct_sim();
+    if (!handle || handle->module_index < 0 || handle->module_index >= sim.moduleNumber ||
+        !sim.module[handle->module_index].used) {
+        return NULL;
+    }
+    return &sim.module[handle->module_index];
+}
+
+// Looks a variable up, the way DCT does: comparing names slot by slot
+inline DctSimVariable* dct_sim_find(DctSimModule* m, const char* name) {
+    DctSim& sim = dct_sim();
+    for (uint16_t i = 0; i < sim.capacity; i++) {
+        dct_sim_read(sim.nameSize);
+        if (m->var[i].used && !strncmp(m->var[i].name, name, sim.nameSize)) {
+            return &m->var[i];
+        }
+    }
+    return NULL;
+}
+
+inline int32_t dct_init(uint32_t begin_address, uint16_t module_number,
+                        uint16_t variable_name_size, uint16_t variable_value_size,
+                        uint8_t enable_backup, uint8_t enable_wear_leveling) {
+    (void)begin_address; (void)enable_wear_leveling;
+    DctSim& sim = dct_sim();
+    sim.count.calls++;
+    if (!module_number || module_number > DCT_SIM_MAX_MODULES ||
+        !variable_name_size || variable_name_size > sizeof(sim.module[0].var[0].name) ||
+        variable_value_size > sizeof(sim.module[0].var[0].value) ||
+        variable_name_size + variable_value_size > DCT_SIM_MODULE_SIZE - DCT_SIM_MODULE_HEADER) {
+        return DCT_ERR_INVALID;
+    }
+    sim.moduleNumber = module_number;
+    sim.nameSize     = variable_name_size;
+    sim.valueSize    = variable_value_size;
+    sim.capacity     = (DCT_SIM_MODULE_SIZE - DCT_SIM_MODULE_HEADER) / (variable_name_size + variable_value_size);
+    if (sim.capacity > DCT_SIM_MAX_VARIABLES) {
+        sim.capacity = DCT_SIM_MAX_VARIABLES;
+    }
+    sim.copies       = enable_backup ? 2 : 1;
+    sim.ready        = true;
+    return DCT_SUCCESS;
+}
+
+inline int32_t dct_register_module(char* module_name) {
+    DctSim& sim = dct_sim();
+    sim.count.calls++;
+    sim.count.modules++;
+    if (!sim.ready) {
+        return DCT_ERR;
+    }
+    if (!module_name || strlen(module_name) > MODULE_NAME_SIZE) {
+        return DCT_ERR_SIZE_OVER;
+    }
+    int32_t empty = -1;
+    for (int32_t i = 0; i < sim.moduleNumber; i++) {
+        dct_sim_read(MODULE_NAME_SIZE);
+        if (sim.module[i].used && !strcmp(sim.module[i].name, module_name)) {
+            return DCT_SUCCESS; // already registered
+        }
+        if (!sim.module[i].used && empty < 0) {
+            empty = i;
+        }
+    }
+    if (empty < 0) {
+        return DCT_ERR_NO_SPACE;
+    }
+    memset(&sim.module[empty], 0, sizeof(DctSimModule));
+    sim.module[empty].used = true;
+    strcpy(sim.module[empty].name, module_name);
+    dct_sim_rewrite();
+    return DCT_SUCCESS;
+}
+
+inline int32_t dct_unregister_module(char* module_name) {
+    DctSim& sim = dct_sim();
+    sim.count.calls++;
+    sim.count.modules++;
+    for (int32_t i = 0; sim.ready && module_name && i < sim.moduleNumber; i++) {
+        if (sim.module[i].used && !strcmp(sim.module[i].name, module_name)) {
+            sim.module[i].used = false;
+            dct_sim_rewrite();
+            return DCT_SUCCESS;
+        }
+    }
+    return DCT_ERR_NOT_FIND;
+}
+
+inline int32_t dct_open_module(dct_handle_t* dct_handle, char* module_name) {
+    DctSim& sim = dct_sim();
+    sim.count.calls++;
+    sim.count.modules++;
+    for (int32_t i = 0; sim.ready && dct_handle && module_name && i < sim.moduleNumber; i++) {
+        dct_sim_read(MODULE_NAME_SIZE);
+        if (sim.module[i].used && !strcmp(sim.module[i].name, module_name)) {
+            memset(dct_handle, 0, sizeof(*dct_handle));
+            strcpy(dct_handle->module_name, module_name);
+            dct_handle->module_index = i;
+            return DCT_SUCCESS;
+        }
+    }
+    return DCT_ERR_NOT_FIND;
+}
+
+inline int32_t dct_close_module(dct_handle_t* dct_handle) {
+    DctSim& sim = dct_sim();
+    sim.count.calls++;
+    sim.count.modules++;
+    if (!dct_handle) {
+        return DCT_ERR;
+    }
+    dct_handle->module_index = -1;
+    return DCT_SUCCESS;
+}
+
+inline int32_t dct_set_variable_new(dct_handle_t* dct_handle, char* variable_name,
+                                    char* variable_value, uint16_t variable_value_length) {
+    DctSim& sim = dct_sim();
+    sim.count.calls++;
+    sim.count.sets++;
+    DctSimModule* m = dct_sim_module(dct_handle);
+    if (!m || !variable_name || (!variable_value && variable_value_length)) {
+        return DCT_ERR;
+    }
+    if (strlen(variable_name) >= sim.nameSize || variable_value_length > sim.valueSize) {
+        return DCT_ERR_SIZE_OVER;
+    }
+    DctSimVariable* v = dct_sim_find(m, variable_name);
+    for (uint16_t i = 0; !v && i < sim.capacity; i++) {
+        if (!m->var[i].used) {
+            v = &m->var[i];
+        }
+    }
+    if (!v) {
+        return DCT_ERR_NO_SPACE;
+    }
+    v->used   = true;
+    v->length = variable_value_length;
+    strcpy(v->name, variable_name); // shorter than nameSize, checked above
+    if (variable_value_length) {
+        memcpy(v->value, variable_value, variable_value_length);
+    }
+    dct_sim_rewrite();
+    return DCT_SUCCESS;
+}
+
+inline int32_t dct_get_variable_new(dct_handle_t* dct_handle, char* variable_name,
+                                    char* buffer, uint16_t* buffer_size) {
+    DctSim& sim = dct_sim();
+    sim.count.calls++;
+    sim.count.gets++;
+    DctSimModule* m = dct_sim_module(dct_handle);
+    if (!m || !variable_name || !buffer_size) {
+        return DCT_ERR;
+    }
+    DctSimVariable* v = dct_sim_find(m, variable_name);
+    if (!v) {
+        return DCT_ERR_NOT_FIND;
+    }
+    if (v->length > *buffer_size) {
+        return DCT_ERR_SIZE_OVER;
+    }
+    if (v->length) {
+        memcpy(buffer, v->value, v->length);
+    }
+    dct_sim_read(v->length);
+    *buffer_size = v->length;
+    return DCT_SUCCESS;
+}
+
+inline int32_t dct_delete_variable_new(dct_handle_t* dct_handle, char* variable_name) {
+    DctSim& sim = dct_sim();
+    sim.count.calls++;
+    sim.count.deletes++;
+    DctSimModule* m = dct_sim_module(dct_handle);
+    if (!m || !variable_name) {
+        return DCT_ERR;
+    }
+    DctSimVariable* v = dct_sim_find(m, variable_name);
+    if (!v) {
+        return DCT_ERR_NOT_FIND;
+    }
+    v->used = false;
+    dct_sim_rewrite();
+    return DCT_SUCCESS;
+}
+
+inline int32_t dct_remain_variable(dct_handle_t* dct_handle) {
+    DctSim& sim = dct_sim();
+    sim.count.calls++;
+    sim.count.lookups++;
+    DctSimModule* m = dct_sim_module(dct_handle);
+    if (!m) {
+        return DCT_ERR;
+    }
+    int32_t remain = 0;
+    for (uint16_t i = 0; i < sim.capacity; i++) {
+        remain += !m->var[i].used;
+    }
+    return remain;
+}
+
+inline uint16_t dct_get_variable_num(dct_handle_t* dct_handle) {
+    DctSim& sim = dct_sim();
+    sim.count.calls++;
+    sim.count.lookups++;
+    DctSimModule* m = dct_sim_module(dct_handle);
+    uint16_t num = 0;
+    for (uint16_t i = 0; m && i < sim.capacity; i++) {
+        num += m->var[i].used;
+    }
+    return num;
+}
+
+// Name of the `index`th variable of the module, in `variable_name` (nameSize bytes)
+inline int32_t dct_get_variable_name(dct_handle_t* dct_handle, uint16_t index, uint8_t* variable_name) {
+    DctSim& sim = dct_sim();
+    sim.count.calls++;
+    sim.count.lookups++;
+    DctSimModule* m = dct_sim_module(dct_handle);
+    if (!m || !variable_name) {
+        return DCT_ERR;
+    }
+    for (uint16_t i = 0; i < sim.capacity; i++) {
+        if (m->var[i].used && index-- == 0) {
+            dct_sim_read(sim.nameSize);
+            memcpy(variable_name, m->var[i].name, sim.nameSize);
+            return DCT_SUCCESS;
+        }
+    }
+    return DCT_ERR_NOT_FIND;
+}
+
+#endif
@@ -0,0 +1,122 @@
+/*
+ * Power loss on the POSIX backend: open(), write(), rename() and unlink()
+ * are replaced for the whole test program (like operator new in the tests),
+ * and counted once posix_fault_cut_power() is called.
+ *
+ * The storage is the real filesystem, so a power loss is a crash of the
+ * process: the operations done so far are kept in order, and the one that's
+ * interrupted is either not done (open, rename, unlink) or done half-way (a
+ * write keeps the first half of its bytes). Reordering by the filesystem
+ * cache on a real power loss isn't simulated.
+ *
+ * Include it in a single file of the program.
+ */
+
+#ifndef POSIX_FAULT_H
+#define POSIX_FAULT_H
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// The replacements are defined under other names, and given the symbols of
+// the libc functions, so they don't clash with their (fortified) declarations
+#define POSIX_FAULT_STR2(x) #x
+#define POSIX_FAULT_STR(x)  POSIX_FAULT_STR2(x)
+#define POSIX_FAULT_SYMBOL(name) __asm__(POSIX_FAULT_STR(__USER_LABEL_PREFIX__) #name)
+
+extern "C" int     posix_fault_open(const char* path, int flags, ...) POSIX_FAULT_SYMBOL(open);
+extern "C" ssize_t posix_fault_write(int fd, const void* buf, size_t count) POSIX_FAULT_SYMBOL(write);
+extern "C" int     posix_fault_rename(const char* from, const char* to) POSIX_FAULT_SYMBOL(rename);
+extern "C" int     posix_fault_unlink(const char* path) POSIX_FAULT_SYMBOL(unlink);
+
+struct PosixFault {
+    bool     cutArmed;
+    bool     off;        // power was lost: changes fail
+    uint32_t cutAfter;   // changes left before the power loss
+    void   (*onCut)();
+};
+
+inline PosixFault& posix_fault() {
+    static PosixFault fault;
+    return fault;
+}
+
+// Loses power after `ops` more changes (creates, writes, renames, deletes):
+// the next one is interrupted, then `onCut` is called. It shouldn't return
+// (e.g. it ends a forked process); if it does, or if it's NULL, later
+// changes fail.
+inline void posix_fault_cut_power(uint32_t ops, void (*onCut)()) {
+    PosixFault& f = posix_fault();
+    f.cutArmed = true;
+    f.cutAfter = ops;
+    f.onCut    = onCut;
+}
+
+inline void posix_fault_no_power_cut() {
+    posix_fault().cutArmed = false;
+}
+
+// True if power is lost during this change
+inline bool posix_fault_power_lost() {
+    PosixFault& f = posix_fault();
+    if (!f.cutArmed) {
+        return false;
+    }
+    if (f.cutAfter) {
+        f.cutAfter--;
+        return false;
+    }
+    f.cutArmed = false;
+    f.off      = true;
+    return true;
+}
+
+inline bool posix_fault_cut(bool lost) {
+    if (lost && posix_fault().onCut) {
+        posix_fault().onCut();
+    }
+    return lost || posix_fault().off;
+}
+
+extern "C" int posix_fault_open(const char* path, int flags, ...) {
+    mode_t mode = 0;
+    if (flags & O_CREAT) {
+        va_list ap;
+        va_start(ap, flags);
+        mode = (mode_t)va_arg(ap, int);
+        va_end(ap);
+    }
+    if ((flags & (O_CREAT | O_TRUNC)) && posix_fault_cut(posix_fault_power_lost())) {
+        return -1;
+    }
+    return openat(AT_FDCWD, path, flags, mode);
+}
+
+extern "C" ssize_t posix_fault_write(int fd, const void* buf, size_t count) {
+    bool lost = posix_fault_power_lost();
+    if (posix_fault().off && !lost) {
+        return -1;
+    }
+    struct iovec iov = { (void*)buf, lost ? count / 2 : count };
+    ssize_t n = writev(fd, &iov, 1);
+    return posix_fault_cut(lost) ? -1 : n;
+}
+
+extern "C" int posix_fault_rename(const char* from, const char* to) {
+    if (posix_fault_cut(posix_fault_power_lost())) {
+        return -1;
+    }
+    return renameat(AT_FDCWD, from, AT_FDCWD, to);
+}
+
+extern "C" int posix_fault_unlink(const char* path) {
+    if (posix_fault_cut(posix_fault_power_lost())) {
+        return -1;
+    }
+    return unlinkat(AT_FDCWD, path, 0);
+}
+
+#endif
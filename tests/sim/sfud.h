@@ -0,0 +1,247 @@
+/*
+ * In-memory stand-in for the SFUD API, so the SFUD backend builds and runs
+ * on the host (see the native-sfud env in platformio.ini).
+ *
+ * It behaves like NOR flash: erase sets whole sectors to 0xFF, and a write
+ * can only program bits from 1 to 0. Writes that would need a 0 -> 1 change
+ * are applied the way the chip would (bitwise AND), and counted in
+ * `badWrites`, since they are bugs in the caller.
+ *
+ * Every call is counted, with a simulated time based on the typical timings
+ * of a W25Q32 on a 50MHz SPI bus (the Wio Terminal flash).
+ *
+ * sfud_sim_cut_power() simulates a power loss during a page program or a
+ * sector erase, which is then left half done (see the power loss tests).
+ * With SFUD_SIM_CUT_DONE=0, the power is lost before it starts instead.
+ */
+
+#ifndef SFUD_SIM_H
+#define SFUD_SIM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#ifndef SFUD_SIM_CAPACITY
+  #define SFUD_SIM_CAPACITY    (64*1024)
+#endif
+#ifndef SFUD_SIM_SECTOR_SIZE
+  #define SFUD_SIM_SECTOR_SIZE 4096
+#endif
+#ifndef SFUD_SIM_PAGE_SIZE
+  #define SFUD_SIM_PAGE_SIZE   256
+#endif
+
+#ifndef SFUD_SIM_CUT_DONE
+  #define SFUD_SIM_CUT_DONE    50          // percent of the interrupted program or erase that gets done
+#endif
+
+// Simulated timings, in nanoseconds
+#ifndef SFUD_SIM_CMD_NS
+  #define SFUD_SIM_CMD_NS      1000        // command and address
+#endif
+#ifndef SFUD_SIM_BYTE_NS
+  #define SFUD_SIM_BYTE_NS     160         // one byte on the bus
+#endif
+#ifndef SFUD_SIM_PROGRAM_NS
+  #define SFUD_SIM_PROGRAM_NS  700000      // page program
+#endif
+#ifndef SFUD_SIM_ERASE_NS
+  #define SFUD_SIM_ERASE_NS    45000000    // sector erase
+#endif
+
+typedef enum {
+    SFUD_SUCCESS = 0,
+    SFUD_ERR_NOT_FOUND = 1,
+    SFUD_ERR_WRITE = 2,
+    SFUD_ERR_READ = 3,
+    SFUD_ERR_TIMEOUT = 4,
+    SFUD_ERR_ADDR_OUT_OF_BOUND = 5,
+} sfud_err;
+
+typedef struct {
+    const char* name;
+    uint32_t    capacity;
+    uint32_t    erase_gran;
+} sfud_chip;
+
+typedef struct {
+    const char* name;
+    size_t      index;
+    sfud_chip   chip;
+} sfud_flash;
+
+struct SfudSimCounters {
+    uint32_t reads;
+    uint32_t writes;
+    uint32_t erases;
+    uint32_t pages;         // pages programmed
+    uint32_t badWrites;     // writes that tried to set a bit
+    uint64_t bytesRead;
+    uint64_t bytesWritten;
+    uint64_t timeNs;        // simulated time spent in the flash
+};
+
+struct SfudSim {
+    uint8_t         mem[SFUD_SIM_CAPACITY];
+    uint32_t        wear[SFUD_SIM_CAPACITY / SFUD_SIM_SECTOR_SIZE]; // erases per sector
+    SfudSimCounters count;
+    sfud_flash      flash;
+    bool            ready;
+    bool            cutArmed;
+    bool            off;        // power was lost: writes and erases fail
+    uint32_t        cutAfter;   // page programs or erases left before the power loss
+    void          (*onCut)();
+};
+
+inline SfudSim& sfud_sim() {
+    static SfudSim sim;
+    static bool    blank = (memset(sim.mem, 0xFF, sizeof(sim.mem)), true); // a new chip
+    (void)blank;
+    return sim;
+}
+
+// Swaps in a new chip, filled with `fill` (0xFF is blank, anything else needs
+// an erase). Call it before the first Preferences::begin().
+inline void sfud_sim_reset(uint8_t fill = 0xFF) {
+    SfudSim& sim = sfud_sim();
+    memset(sim.mem, fill, sizeof(sim.mem));
+    memset(sim.wear, 0, sizeof(sim.wear));
+    memset(&sim.count, 0, sizeof(sim.count));
+    sim.ready    = false;
+    sim.cutArmed = false;
+    sim.off      = false;
+}
+
+inline SfudSimCounters sfud_sim_counters() {
+    return sfud_sim().count;
+}
+
+inline void sfud_sim_reset_counters() {
+    memset(&sfud_sim().count, 0, sizeof(sfud_sim().count));
+}
+
+// Loses power after `ops` more page programs or sector erases: the next one
+// is interrupted half-way, then `onCut` is called. It shouldn't return (e.g.
+// it ends a forked process); if it does, or if it's NULL, the flash stays
+// off and later writes and erases fail.
+inline void sfud_sim_cut_power(uint32_t ops, void (*onCut)()) {
+    SfudSim& sim = sfud_sim();
+    sim.cutArmed = true;
+    sim.cutAfter = ops;
+    sim.onCut    = onCut;
+}
+
+inline void sfud_sim_no_power_cut() {
+    sfud_sim().cutArmed = false;
+}
+
+// True if power is lost during this program or erase
+inline bool sfud_sim_power_lost(SfudSim& sim) {
+    if (!sim.cutArmed) {
+        return false;
+    }
+    if (sim.cutAfter) {
+        sim.cutAfter--;
+        return false;
+    }
+    sim.cutArmed = false;
+    sim.off      = true;
+    return true;
+}
+
+inline sfud_err sfud_init() {
+    SfudSim& sim = sfud_sim();
+    sim.flash.name             = "sfud_sim";
+    sim.flash.index            = 0;
+    sim.flash.chip.name        = "W25Q32 (simulated)";
+    sim.flash.chip.capacity    = SFUD_SIM_CAPACITY;
+    sim.flash.chip.erase_gran  = SFUD_SIM_SECTOR_SIZE;
+    sim.ready = true;
+    return SFUD_SUCCESS;
+}
+
+inline sfud_flash* sfud_get_device(size_t index) {
+    SfudSim& sim = sfud_sim();
+    if (index != 0) {
+        return NULL;
+    }
+    if (!sim.ready) {
+        sim.flash.chip.capacity = 0; // not probed yet
+    }
+    return &sim.flash;
+}
+
+inline sfud_err sfud_read(const sfud_flash* flash, uint32_t addr, size_t size, uint8_t* data) {
+    SfudSim& sim = sfud_sim();
+    if (flash != &sim.flash || addr + size > SFUD_SIM_CAPACITY) {
+        return SFUD_ERR_ADDR_OUT_OF_BOUND;
+    }
+    memcpy(data, sim.mem + addr, size);
+    sim.count.reads++;
+    sim.count.bytesRead += size;
+    sim.count.timeNs    += SFUD_SIM_CMD_NS + size * SFUD_SIM_BYTE_NS;
+    return SFUD_SUCCESS;
+}
+
+// Like sfud_write(), split into page programs
+inline sfud_err sfud_write(const sfud_flash* flash, uint32_t addr, size_t size, const uint8_t* data) {
+    SfudSim& sim = sfud_sim();
+    if (flash != &sim.flash || addr + size > SFUD_SIM_CAPACITY) {
+        return SFUD_ERR_ADDR_OUT_OF_BOUND;
+    }
+    if (sim.off) {
+        return SFUD_ERR_WRITE;
+    }
+    sim.count.writes++;
+    bool bad = false;
+    for (size_t i = 0; i < size; ) {
+        size_t n = SFUD_SIM_PAGE_SIZE - (addr + i) % SFUD_SIM_PAGE_SIZE;
+        if (n > size - i) {
+            n = size - i;
+        }
+        bool lost = sfud_sim_power_lost(sim);
+        for (size_t j = i; j < i + (lost ? n * SFUD_SIM_CUT_DONE / 100 : n); j++) {
+            bad |= (data[j] & ~sim.mem[addr + j]) != 0;
+            sim.mem[addr + j] &= data[j];
+        }
+        if (lost) {
+            if (sim.onCut) sim.onCut();
+            return SFUD_ERR_WRITE;
+        }
+        sim.count.pages++;
+        sim.count.timeNs += SFUD_SIM_CMD_NS + n * SFUD_SIM_BYTE_NS + SFUD_SIM_PROGRAM_NS;
+        i += n;
+    }
+    sim.count.badWrites    += bad;
+    sim.count.bytesWritten += size;
+    return SFUD_SUCCESS;
+}
+
+inline sfud_err sfud_erase(const sfud_flash* flash, uint32_t addr, size_t size) {
+    SfudSim& sim = sfud_sim();
+    if (flash != &sim.flash || addr + size > SFUD_SIM_CAPACITY) {
+        return SFUD_ERR_ADDR_OUT_OF_BOUND;
+    }
+    if (sim.off) {
+        return SFUD_ERR_WRITE;
+    }
+    // Whole sectors are erased, like the chip does
+    uint32_t first = addr / SFUD_SIM_SECTOR_SIZE;
+    uint32_t last  = size ? (addr + size - 1) / SFUD_SIM_SECTOR_SIZE : first;
+    for (uint32_t s = first; s <= last; s++) {
+        if (sfud_sim_power_lost(sim)) {
+            // Only the start of the sector is erased
+            memset(sim.mem + s * SFUD_SIM_SECTOR_SIZE, 0xFF, SFUD_SIM_SECTOR_SIZE * SFUD_SIM_CUT_DONE / 100);
+            if (sim.onCut) sim.onCut();
+            return SFUD_ERR_WRITE;
+        }
+        memset(sim.mem + s * SFUD_SIM_SECTOR_SIZE, 0xFF, SFUD_SIM_SECTOR_SIZE);
+        sim.wear[s]++;
+        sim.count.erases++;
+        sim.count.timeNs += SFUD_SIM_CMD_NS + SFUD_SIM_ERASE_NS;
+    }
+    return SFUD_SUCCESS;
+}
+
+#endif
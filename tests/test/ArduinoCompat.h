@@ -45,6 +45,26 @@ inline String operator+(const char* lhs, const String& rhs) {
     return String(lhs) + rhs;
 }
 
+// The subset of Arduino's Stream (and Print) used by the library
+class Stream {
+public:
+    virtual ~Stream() {}
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t* buf, size_t len) {
+        size_t n = 0;
+        while (n < len && write(buf[n])) n++;
+        return n;
+    }
+    size_t readBytes(char* buf, size_t len) {
+        size_t n = 0;
+        for (int c; n < len && (c = read()) >= 0; n++) buf[n] = (char)c;
+        return n;
+    }
+};
+
 #endif // __cplusplus
 
 #endif
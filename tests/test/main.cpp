@@ -7,6 +7,24 @@
   #include <Preferences.h>
 #endif
 
+#if !defined(ARDUINO)
+  // Count heap allocations on the native build
+  #include <new>
+  #include <stdlib.h>
+
+  static size_t gHeapAllocs;
+
+  void* operator new(size_t size) {
+    gHeapAllocs++;
+    if (void* p = malloc(size ? size : 1)) {
+      return p;
+    }
+    throw std::bad_alloc();
+  }
+  void operator delete(void* p) noexcept { free(p); }
+  void operator delete(void* p, size_t) noexcept { free(p); }
+#endif
+
 void setUp(void) {
 }
 
@@ -310,6 +328,40 @@ void test_begin_twice() {
   TEST_ASSERT_TRUE(prefs.clear());
 }
 
+#if !defined(NVS_USE_DCT) && !defined(NVS_USE_WIFININA)
+void test_begin_long_name() {
+  Preferences prefs;
+#if defined(NVS_USE_SFUD)
+  TEST_ASSERT_FALSE(prefs.begin("namespace_too_long")); // over 15 characters
+#else
+  // File systems take any namespace their file names can hold
+  TEST_ASSERT_TRUE(prefs.begin("namespace_longer_than_15"));
+  TEST_ASSERT_TRUE(prefs.putUInt("k", 1));
+  TEST_ASSERT_EQUAL_UINT(1, prefs.getUInt("k"));
+  TEST_ASSERT_TRUE(prefs.clear());
+  prefs.end();
+
+  char name[300];
+  memset(name, 'n', sizeof(name) - 1);
+  name[sizeof(name) - 1] = '\0';
+  TEST_ASSERT_FALSE(prefs.begin(name));
+#endif
+  TEST_ASSERT_TRUE(prefs.begin("namespace_15chr"));
+  TEST_ASSERT_TRUE(prefs.putUInt("key_of_15_chars", 15));
+  TEST_ASSERT_EQUAL_UINT(15, prefs.getUInt("key_of_15_chars"));
+#if !defined(NVS_PACKED)
+  // Longer keys are refused by every call, not only by some
+  uint32_t v = 16;
+  PreferenceEntry e = { "key_of_16_chars_", &v, sizeof(v) };
+  TEST_ASSERT_EQUAL_UINT(0, prefs.putUInt("key_of_16_chars_", 16));
+  TEST_ASSERT_EQUAL_UINT(0, prefs.putEntries(&e, 1));
+  TEST_ASSERT_FALSE(prefs.openWriter("key_of_16_chars_", sizeof(v)));
+  TEST_ASSERT_FALSE(prefs.isKey("key_of_16_chars_"));
+#endif
+  TEST_ASSERT_TRUE(prefs.clear());
+}
+#endif
+
 void test_put_string_object_overload() {
   Preferences prefs;
   TEST_ASSERT_TRUE(prefs.begin("test"));
@@ -360,9 +412,888 @@ void test_missing_key_defaults() {
   TEST_ASSERT_TRUE(prefs.clear());
 }
 
+#if !(defined(ESP32) || defined(NVS_USE_WIFININA))
+// Extensions to the ESP32 API
+
+// putEntries() stores a batch of keys in order. A batch with an entry that
+// can't be stored (here: an empty key) is refused as a whole.
+void test_put_entries() {
+  Preferences prefs;
+  TEST_ASSERT_TRUE(prefs.begin("test"));
+
+  uint32_t a = 1, b = 2, c = 3;
+  PreferenceEntry entries[] = {
+    { "a", &a, sizeof(a) },
+    { "b", &b, sizeof(b) },
+    { "a", &c, sizeof(c) }, // same key again: the last value wins
+    { "e", "",  0 },
+  };
+  TEST_ASSERT_EQUAL_UINT(4, prefs.putEntries(entries, 4));
+  TEST_ASSERT_EQUAL_UINT(3, prefs.getUInt("a"));
+  TEST_ASSERT_EQUAL_UINT(2, prefs.getUInt("b"));
+  TEST_ASSERT_TRUE(prefs.isKey("e"));
+
+  PreferenceEntry invalid[] = {
+    { "b", &c, sizeof(c) },
+    { "",  &c, sizeof(c) },
+    { "c", &c, sizeof(c) },
+  };
+  TEST_ASSERT_EQUAL_UINT(0, prefs.putEntries(invalid, 3));
+  TEST_ASSERT_EQUAL_UINT(2, prefs.getUInt("b"));
+  TEST_ASSERT_FALSE(prefs.isKey("c"));
+
+  TEST_ASSERT_TRUE(prefs.clear());
+}
+
+// Puts are kept in RAM until commit(), and dropped by rollback().
+// Only where putEntries() is all-or-nothing.
+void test_transaction() {
+  Preferences prefs;
+  TEST_ASSERT_TRUE(prefs.begin("test"));
+#if !defined(NVS_ATOMIC_BATCH)
+  TEST_ASSERT_FALSE(prefs.beginTransaction());
+#else
+  TEST_ASSERT_TRUE(prefs.beginTransaction());
+  TEST_ASSERT_FALSE(prefs.beginTransaction()); // already open
+  TEST_ASSERT_EQUAL_UINT(4, prefs.putInt("x", 1));
+  TEST_ASSERT_EQUAL_UINT(4, prefs.putInt("y", 2));
+  TEST_ASSERT_EQUAL_UINT(4, prefs.putInt("x", 3));
+  TEST_ASSERT_FALSE(prefs.isKey("x")); // not committed yet
+  TEST_ASSERT_TRUE(prefs.commit());
+  TEST_ASSERT_EQUAL_INT(3, prefs.getInt("x"));
+  TEST_ASSERT_EQUAL_INT(2, prefs.getInt("y"));
+  TEST_ASSERT_FALSE(prefs.commit()); // no open transaction
+
+  TEST_ASSERT_TRUE(prefs.beginTransaction());
+  TEST_ASSERT_EQUAL_UINT(4, prefs.putInt("x", 4));
+  TEST_ASSERT_EQUAL_UINT(4, prefs.putInt("z", 5));
+  prefs.rollback();
+  TEST_ASSERT_EQUAL_INT(3, prefs.getInt("x"));
+  TEST_ASSERT_FALSE(prefs.isKey("z"));
+
+  TEST_ASSERT_TRUE(prefs.clear());
+#endif
+}
+
+// Typed keys: the value type is checked at compile time
+static constexpr PreferenceKey<uint32_t> KEY_COUNT("count");
+static constexpr PreferenceKey<float>    KEY_RATIO("ratio");
+static constexpr PreferenceKey<bool>     KEY_FLAG("flag");
+static constexpr PreferenceKey<String>   KEY_NAME("name");
+
+static_assert(KEY_COUNT.length == 5, "length is computed at compile time");
+
+void test_typed_keys() {
+  Preferences prefs;
+  TEST_ASSERT_TRUE(prefs.begin("test"));
+
+  TEST_ASSERT_EQUAL_UINT(7, prefs.get(KEY_COUNT, 7));
+  TEST_ASSERT_EQUAL_UINT(4, prefs.put(KEY_COUNT, 1));
+  TEST_ASSERT_EQUAL_UINT(4, prefs.put(KEY_COUNT, prefs.get(KEY_COUNT) + 1));
+  TEST_ASSERT_EQUAL_UINT(2, prefs.get(KEY_COUNT));
+  TEST_ASSERT_EQUAL_UINT(2, prefs.getUInt("count"));
+
+  prefs.put(KEY_RATIO, 0.5f);
+  TEST_ASSERT_EQUAL_FLOAT(0.5f, prefs.get(KEY_RATIO));
+  prefs.put(KEY_FLAG, true);
+  TEST_ASSERT_TRUE(prefs.get(KEY_FLAG));
+  prefs.put(KEY_NAME, String("abc"));
+  TEST_ASSERT_EQUAL_STRING("abc", prefs.get(KEY_NAME).c_str());
+
+  TEST_ASSERT_TRUE(prefs.clear());
+}
+
+// Values are streamed in chunks, and only stored once complete
+void test_streams() {
+  Preferences prefs;
+  TEST_ASSERT_TRUE(prefs.begin("test"));
+
+#if defined(NVS_USE_DCT)
+  static uint8_t data[128]; // DCT values are limited to 128+4 bytes
+#else
+  static uint8_t data[300];
+#endif
+  for (size_t i = 0; i < sizeof(data); i++) data[i] = (uint8_t)(i * 7);
+
+  PreferenceWriter w = prefs.openWriter("blob", sizeof(data));
+  TEST_ASSERT_TRUE(w);
+  for (size_t pos = 0; pos < sizeof(data); pos += 7) {
+    size_t n = (sizeof(data) - pos < 7) ? sizeof(data) - pos : 7;
+    TEST_ASSERT_EQUAL_UINT(n, w.write(data + pos, n));
+  }
+  TEST_ASSERT_EQUAL_UINT(0, w.write(data, 1)); // past the announced size
+  TEST_ASSERT_TRUE(w.close());
+  TEST_ASSERT_EQUAL_UINT(sizeof(data), prefs.getBytesLength("blob"));
+
+  PreferenceReader r = prefs.openReader("blob");
+  TEST_ASSERT_TRUE(r);
+  TEST_ASSERT_EQUAL_UINT(sizeof(data), r.size());
+  static uint8_t out[sizeof(data)];
+  size_t got = 0;
+  for (size_t n; (n = r.read(out + got, 11)) > 0; ) got += n;
+  TEST_ASSERT_EQUAL_UINT(sizeof(data), got);
+  TEST_ASSERT_EQUAL_MEMORY(data, out, sizeof(data));
+  TEST_ASSERT_FALSE(prefs.openReader("missing"));
+
+  // Sizes the backend can't hold are refused upfront
+#if defined(NVS_USE_DCT)
+  TEST_ASSERT_FALSE(prefs.openWriter("big", 128 + 4 + 1));
+#elif defined(SFUD_SIM_H)
+  TEST_ASSERT_FALSE(prefs.openWriter("big", 1024 + 1));
+#endif
+
+  // An incomplete value is dropped
+  {
+    PreferenceWriter partial = prefs.openWriter("blob", 10);
+    TEST_ASSERT_EQUAL_UINT(5, partial.write(data, 5));
+  }
+  TEST_ASSERT_EQUAL_UINT(sizeof(data), prefs.getBytesLength("blob"));
+  PreferenceWriter partial = prefs.openWriter("blob", 10);
+  partial.write(data, 5);
+  TEST_ASSERT_FALSE(partial.close());
+  TEST_ASSERT_EQUAL_UINT(sizeof(data), prefs.getBytesLength("blob"));
+
+  // A batch written meanwhile doesn't disturb an open writer
+  PreferenceWriter other = prefs.openWriter("blob", 10);
+  TEST_ASSERT_EQUAL_UINT(5, other.write(data, 5));
+  PreferenceEntry batch[2] = { { "blob", "batch", 5 }, { "c", "c", 1 } };
+  TEST_ASSERT_EQUAL_UINT(2, prefs.putEntries(batch, 2));
+  TEST_ASSERT_EQUAL_UINT(5, other.write(data + 5, 5));
+  TEST_ASSERT_TRUE(other.close());
+  TEST_ASSERT_EQUAL_UINT(10, prefs.getBytes("blob", out, sizeof(out)));
+  TEST_ASSERT_EQUAL_MEMORY(data, out, 10);
+
+  TEST_ASSERT_TRUE(prefs.clear());
+}
+
+// Repeated reads are served by the cache, and writes update it
+void test_cache() {
+  Preferences prefs;
+  TEST_ASSERT_TRUE(prefs.setCacheSize(64));
+  TEST_ASSERT_TRUE(prefs.begin("test"));
+
+  prefs.putInt("x", 1);
+  TEST_ASSERT_EQUAL_INT(1, prefs.getInt("x"));
+  TEST_ASSERT_EQUAL_INT(1, prefs.getInt("x"));
+  TEST_ASSERT_EQUAL_UINT(1, prefs.cacheMisses());
+  TEST_ASSERT_EQUAL_UINT(1, prefs.cacheHits());
+
+  prefs.putInt("x", 2);
+  TEST_ASSERT_EQUAL_INT(2, prefs.getInt("x"));
+  TEST_ASSERT_TRUE(prefs.remove("x"));
+  TEST_ASSERT_EQUAL_INT(7, prefs.getInt("x", 7));
+
+  // Only the most recently used values are kept
+  char key[] = "k0";
+  for (int i = 0; i < 8; i++, key[1]++) {
+    prefs.putInt(key, i);
+    TEST_ASSERT_EQUAL_INT(i, prefs.getInt(key));
+  }
+  TEST_ASSERT_EQUAL_INT(7, prefs.getInt("k7"));
+  TEST_ASSERT_EQUAL_INT(0, prefs.getInt("k0"));
+
+  // Strings, lengths and isKey() are served by the cache too
+  prefs.putString("s", "hello");
+  TEST_ASSERT_EQUAL_STRING("hello", prefs.getString("s").c_str());
+  uint32_t hits = prefs.cacheHits();
+  char str[8];
+  TEST_ASSERT_EQUAL_STRING("hello", prefs.getString("s", "none").c_str());
+  TEST_ASSERT_EQUAL_UINT(5, prefs.getString("s", str, sizeof(str)));
+  TEST_ASSERT_EQUAL_STRING("hello", str);
+  TEST_ASSERT_EQUAL_UINT(0, prefs.getString("s", str, 5)); // doesn't fit
+  TEST_ASSERT_TRUE(prefs.isKey("s"));
+  TEST_ASSERT_EQUAL_UINT(5, prefs.getBytesLength("s"));
+  TEST_ASSERT_EQUAL_UINT(hits + 5, prefs.cacheHits());
+  prefs.putString("s", "bye");
+  TEST_ASSERT_EQUAL_STRING("bye", prefs.getString("s").c_str());
+  TEST_ASSERT_EQUAL_UINT(3, prefs.getBytesLength("s"));
+  TEST_ASSERT_TRUE(prefs.remove("s"));
+  TEST_ASSERT_FALSE(prefs.isKey("s"));
+  TEST_ASSERT_EQUAL_STRING("none", prefs.getString("s", "none").c_str());
+
+  TEST_ASSERT_TRUE(prefs.clear());
+  TEST_ASSERT_FALSE(prefs.isKey("k7"));
+  TEST_ASSERT_EQUAL_INT(-1, prefs.getInt("k7", -1));
+}
+
+static bool count_keys(const char* key, const void* value, size_t length, void* arg) {
+  size_t* found = (size_t*)arg;
+  int32_t i = 0;
+  if (length == 4) memcpy(&i, value, 4); // values may be unaligned
+  if (!strcmp(key, "int") && i == 42) found[0]++;
+  if (!strcmp(key, "str") && length == 5 && !memcmp(value, "hello", 5)) found[1]++;
+  if (!strcmp(key, "long") && length == 100 && ((const uint8_t*)value)[99] == 99) found[2]++;
+  return true;
+}
+
+static bool stop_at_first(const char*, const void*, size_t, void*) {
+  return false;
+}
+
+// All keys are visited once, with their values
+void test_for_each() {
+  Preferences prefs;
+  TEST_ASSERT_TRUE(prefs.begin("test"));
+  TEST_ASSERT_TRUE(prefs.clear());
+  TEST_ASSERT_EQUAL_UINT(0, prefs.forEach(count_keys));
+
+  uint8_t data[100];
+  for (size_t i = 0; i < sizeof(data); i++) data[i] = (uint8_t)i;
+  prefs.putInt("int", 42);
+  prefs.putString("str", "hello");
+  prefs.putBytes("long", data, sizeof(data));
+
+  size_t found[3] = { 0, 0, 0 };
+  TEST_ASSERT_EQUAL_UINT(3, prefs.forEach(count_keys, found));
+  TEST_ASSERT_EQUAL_UINT(1, found[0]);
+  TEST_ASSERT_EQUAL_UINT(1, found[1]);
+  TEST_ASSERT_EQUAL_UINT(1, found[2]);
+
+  TEST_ASSERT_EQUAL_UINT(1, prefs.forEach(stop_at_first));
+
+  TEST_ASSERT_TRUE(prefs.clear());
+}
+
+// A Stream over a fixed buffer
+class MemStream : public Stream {
+public:
+  uint8_t data[256];
+  size_t  size = 0;
+  size_t  pos  = 0;
+  size_t  room = sizeof(data); // writes come up short past it
+
+  int available() override { return size - pos; }
+  int read() override { return (pos < size) ? data[pos++] : -1; }
+  int peek() override { return (pos < size) ? data[pos] : -1; }
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t* buf, size_t len) override {
+    if (len > room - size) len = room - size;
+    memcpy(data + size, buf, len);
+    size += len;
+    return len;
+  }
+};
+
+// A namespace exported to an image can be imported elsewhere, and a corrupt image is refused
+void test_export_import() {
+  Preferences src, dst;
+  TEST_ASSERT_TRUE(src.begin("test"));
+  TEST_ASSERT_TRUE(dst.begin("test2"));
+  TEST_ASSERT_TRUE(dst.clear());
+  src.putInt("int", 42);
+  src.putString("str", "hello");
+  src.putBytes("empty", "", 0);
+
+  MemStream image;
+  size_t size = src.exportTo(image);
+  TEST_ASSERT_EQUAL_UINT(image.size, size);
+  TEST_ASSERT_EQUAL_UINT(4 + 3 * 5 + (3 + 4) + (3 + 5) + (5 + 0) + 5, size);
+
+  MemStream full;
+  full.room = 10; // the stream fills up in the middle of the first key
+  TEST_ASSERT_EQUAL_UINT(0, src.exportTo(full));
+  TEST_ASSERT_EQUAL_UINT(10, full.size);
+
+  MemStream corrupt = image;
+  corrupt.data[10] ^= 1;
+  TEST_ASSERT_EQUAL_UINT(0, dst.importFrom(corrupt));
+  TEST_ASSERT_FALSE(dst.isKey("int"));
+  MemStream truncated = image;
+  truncated.size -= 1;
+  TEST_ASSERT_EQUAL_UINT(0, dst.importFrom(truncated));
+  TEST_ASSERT_FALSE(dst.isKey("int"));
+  MemStream huge = image;
+  memset(huge.data + 4 + 1, 0xFF, 4); // length of the first value, before the CRC is checked
+  TEST_ASSERT_EQUAL_UINT(0, dst.importFrom(huge));
+  TEST_ASSERT_FALSE(dst.isKey("int"));
+
+  dst.putInt("other", 7);
+  TEST_ASSERT_EQUAL_UINT(3, dst.importFrom(image));
+  TEST_ASSERT_EQUAL_INT(42, dst.getInt("int"));
+  TEST_ASSERT_EQUAL_STRING("hello", dst.getString("str").c_str());
+  TEST_ASSERT_TRUE(dst.isKey("empty"));
+  TEST_ASSERT_EQUAL_INT(7, dst.getInt("other"));
+
+  TEST_ASSERT_TRUE(src.clear());
+  TEST_ASSERT_TRUE(dst.clear());
+}
+
+// Storage figures follow the keys
+void test_stats() {
+  Preferences prefs;
+  TEST_ASSERT_EQUAL_UINT(0, prefs.stats().entries);
+  TEST_ASSERT_TRUE(prefs.begin("test"));
+  TEST_ASSERT_TRUE(prefs.clear());
+  TEST_ASSERT_EQUAL_UINT(0, prefs.stats().entries);
+
+  prefs.putInt("int", 42);
+  prefs.putString("str", "hello");
+  PreferenceStats st = prefs.stats();
+  TEST_ASSERT_EQUAL_UINT(2, st.entries);
+  TEST_ASSERT_TRUE(st.bytesUsed >= 4 + 5);
+  TEST_ASSERT_TRUE(st.bytesFree > 0);
+  TEST_ASSERT_TRUE(st.blocksUsed <= st.blocksTotal);
+  TEST_ASSERT_TRUE(st.fragmentation <= 100);
+  TEST_ASSERT_TRUE(prefs.freeEntries() > 0);
+
+  TEST_ASSERT_TRUE(prefs.remove("int"));
+  st = prefs.stats();
+  TEST_ASSERT_EQUAL_UINT(1, st.entries);
+
+  TEST_ASSERT_TRUE(prefs.clear());
+}
+
+// Counted when built with NVS_STATS, read as zeros otherwise
+void test_io_stats() {
+  Preferences prefs;
+  TEST_ASSERT_TRUE(prefs.begin("test"));
+  TEST_ASSERT_TRUE(prefs.clear());
+
+  Preferences::resetIoStats();
+  TEST_ASSERT_EQUAL_UINT(sizeof(int32_t), prefs.putInt("int", 42));
+  TEST_ASSERT_EQUAL_INT(42, prefs.getInt("int"));
+  PreferenceIoStats io = Preferences::ioStats();
+#if defined(NVS_STATS)
+  TEST_ASSERT_TRUE(io.write.calls > 0);
+  TEST_ASSERT_TRUE(io.write.bytes >= sizeof(int32_t));
+#else
+  TEST_ASSERT_EQUAL_UINT(0, io.write.calls);
+  TEST_ASSERT_EQUAL_UINT(0, io.read.calls);
+#endif
+
+  Preferences::resetIoStats();
+  io = Preferences::ioStats();
+  TEST_ASSERT_EQUAL_UINT(0, io.read.calls + io.write.calls + io.erase.calls + io.meta.calls);
+  TEST_ASSERT_EQUAL_UINT(0, io.write.bytes);
+
+  TEST_ASSERT_TRUE(prefs.clear());
+}
+
+#endif
+
+#if defined(NVS_USE_POSIX) && !defined(NVS_PACKED)
+#include <sys/stat.h>
+
+// Putting an unchanged value of any size leaves its file alone
+void test_put_same_large_value() {
+  Preferences prefs;
+  TEST_ASSERT_TRUE(prefs.begin("test"));
+
+  static uint8_t big[3000];
+  for (size_t i = 0; i < sizeof(big); i++) big[i] = (uint8_t)i;
+  struct stat before, after;
+  TEST_ASSERT_EQUAL_UINT(sizeof(big), prefs.putBytes("big", big, sizeof(big)));
+  TEST_ASSERT_EQUAL_INT(0, stat(NVS_PATH "/test/big", &before));
+  TEST_ASSERT_EQUAL_UINT(sizeof(big), prefs.putBytes("big", big, sizeof(big)));
+  TEST_ASSERT_EQUAL_INT(0, stat(NVS_PATH "/test/big", &after));
+  TEST_ASSERT_EQUAL_UINT(before.st_ino, after.st_ino);
+
+  big[sizeof(big) - 1] ^= 1;
+  TEST_ASSERT_EQUAL_UINT(sizeof(big), prefs.putBytes("big", big, sizeof(big)));
+  TEST_ASSERT_EQUAL_INT(0, stat(NVS_PATH "/test/big", &after));
+  TEST_ASSERT_NOT_EQUAL(before.st_ino, after.st_ino);
+
+  static uint8_t out[sizeof(big)];
+  TEST_ASSERT_EQUAL_UINT(sizeof(big), prefs.getBytes("big", out, sizeof(out)));
+  TEST_ASSERT_EQUAL_MEMORY(big, out, sizeof(big));
+
+  TEST_ASSERT_TRUE(prefs.clear());
+}
+#endif
+
+#if !defined(ARDUINO)
+// Reading and rewriting a value doesn't allocate String paths
+void test_no_heap_on_access() {
+  Preferences prefs;
+  TEST_ASSERT_TRUE(prefs.begin("test"));
+  prefs.putInt("a_longer_key", 1);
+
+  size_t allocs = gHeapAllocs;
+  for (int i = 0; i < 10; i++) {
+    TEST_ASSERT_EQUAL_UINT(4, prefs.putInt("a_longer_key", i & 1));
+    TEST_ASSERT_EQUAL_INT(i & 1, prefs.getInt("a_longer_key"));
+    TEST_ASSERT_TRUE(prefs.isKey("a_longer_key"));
+    TEST_ASSERT_EQUAL_UINT(4, prefs.getBytesLength("a_longer_key"));
+  }
+  TEST_ASSERT_EQUAL_UINT(allocs, gHeapAllocs);
+
+  TEST_ASSERT_TRUE(prefs.clear());
+}
+#endif
+
+#if defined(NVS_PACKED)
+#if defined(NVS_PACKED_MMAP)
+  #include <sys/wait.h>
+  #include <unistd.h>
+#endif
+
+// getView() points right at the stored value, and follows updates
+void test_view() {
+  Preferences prefs, view;
+  TEST_ASSERT_TRUE(prefs.begin("test"));
+  TEST_ASSERT_TRUE(view.begin("test", true));
+
+  size_t len = 0;
+  TEST_ASSERT_NULL(view.getView("x", &len));
+  prefs.putString("x", "hello");
+  const char* v = (const char*)view.getView("x", &len);
+  TEST_ASSERT_NOT_NULL(v);
+  TEST_ASSERT_EQUAL_UINT(5, len);
+  TEST_ASSERT_EQUAL_MEMORY("hello", v, 5);
+
+  prefs.putString("x", "bye");
+  v = (const char*)view.getView("x", &len);
+  TEST_ASSERT_EQUAL_UINT(3, len);
+  TEST_ASSERT_EQUAL_MEMORY("bye", v, 3);
+
+#if defined(NVS_PACKED_MMAP)
+  // A write from another process is seen after NVS_PACKED_MMAP_RECHECK_MS
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    Preferences other;
+    _exit(other.begin("test") && other.putString("x", "other") == 5 ? 0 : 1);
+  }
+  int status;
+  TEST_ASSERT_EQUAL_INT(pid, waitpid(pid, &status, 0));
+  TEST_ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  usleep((NVS_PACKED_MMAP_RECHECK_MS + 10) * 1000);
+  v = (const char*)view.getView("x", &len);
+  TEST_ASSERT_EQUAL_UINT(5, len);
+  TEST_ASSERT_EQUAL_MEMORY("other", v, 5);
+#endif
+
+  TEST_ASSERT_TRUE(prefs.clear());
+  TEST_ASSERT_NULL(view.getView("x", &len));
+}
+#endif
+
+#if !defined(ARDUINO) && (defined(NVS_USE_POSIX) || defined(SFUD_SIM_H))
+#define TEST_POWER_LOSS
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#if defined(NVS_USE_POSIX)
+  #include <posix_fault.h>
+  #define pl_cut_power(n, onCut)  posix_fault_cut_power(n, onCut)
+  #define pl_no_power_cut()       posix_fault_no_power_cut()
+#else
+  #define pl_cut_power(n, onCut)  sfud_sim_cut_power(n, onCut)
+  #define pl_no_power_cut()       sfud_sim_no_power_cut()
+#endif
+
+/*
+ * Power loss replay: for n = 0, 1, 2... a forked process runs the setup,
+ * then an action with the power cut after n writes or erases. Another one
+ * then boots on what's left in the storage, and checks that each key holds
+ * its old or its new value. This goes on until the action completes.
+ *
+ * Keys k0..k3 are set by the setup, k4..k7 only exist once the action sets
+ * them. Each action is a list of ops, op i (from 1) gives key gPlKey[i] its
+ * value number i. The storage must match the ops up to some point, like if
+ * the ones after it never happened.
+ * */
+
+#define PL_KEYS    8
+#define PL_MAX_OPS 256
+
+enum { PL_PUT, PL_BATCH, PL_CLEAR, PL_MIGRATE };
+enum { PL_DONE = 10, PL_CUT, PL_FAILED };
+
+struct PowerLossShared {
+  char    error[160];
+#if defined(SFUD_SIM_H)
+  uint8_t flash[SFUD_SIM_CAPACITY];  // passed from the process that lost power to the next one
+#endif
+};
+
+static PowerLossShared* gPowerLoss;
+static int              gPlAction;
+static int              gPlOps;
+static uint8_t          gPlKey[PL_MAX_OPS + 1];
+#if defined(SFUD_SIM_H)
+static int              gPlLayout;  // old log converted by PL_MIGRATE
+#endif
+
+static const char* pl_key(int k) {
+  static const char* keys[PL_KEYS] = { "k0", "k1", "k2", "k3", "k4", "k5", "k6", "k7" };
+  return keys[k];
+}
+
+// Value number `version` of key `k`, 8 to 55 bytes long
+static size_t pl_value(uint8_t* buf, int k, int version) {
+  size_t len = 8 + (k * 5 + version * 11) % 48;
+  for (size_t j = 0; j < len; j++) {
+    buf[j] = (uint8_t)(k * 17 + version * 31 + j);
+  }
+  return len;
+}
+
+static void pl_fail(const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(gPowerLoss->error, sizeof(gPowerLoss->error), fmt, ap);
+  va_end(ap);
+  _exit(PL_FAILED);
+}
+
+static void pl_save_storage() {
+#if defined(SFUD_SIM_H)
+  memcpy(gPowerLoss->flash, sfud_sim().mem, sizeof(gPowerLoss->flash));
+#endif
+}
+
+static void pl_power_cut() {
+  pl_save_storage();
+  _exit(PL_CUT);
+}
+
+#if defined(SFUD_SIM_H)
+/*
+ * Logs written by older versions of the library, with the namespace name in
+ * every record: a single log from the start of the region, or a ring of
+ * sectors. The first begin() converts them. They hold k0..k3 (value 0) in
+ * namespace "power" and "x" in "other", after deleted records that take up
+ * some space: the default region is 2 sectors of 4KB.
+ * */
+
+enum { OLD_LOG, OLD_LOG_FULL, OLD_RING, OLD_LOG_TOO_FULL };
+
+static uint32_t old_record(uint32_t off, uint32_t magic, const char* ns, const char* key, const uint8_t* value, size_t len) {
+  uint8_t* p       = sfud_sim().mem + off;
+  uint8_t  ns_len  = strlen(ns);
+  uint8_t  key_len = strlen(key);
+  memcpy(p, &magic, 4);
+  p[4] = ns_len;
+  p[5] = key_len;
+  p[6] = len & 0xFF;
+  p[7] = len >> 8;
+  memcpy(p + 8, ns, ns_len);
+  memcpy(p + 8 + ns_len, key, key_len);
+  memcpy(p + 8 + ns_len + key_len, value, len);
+  return off + ((8 + ns_len + key_len + len + 3) & ~3u);
+}
+
+static void old_log(int layout) {
+  static const uint32_t active = 0x53465042, deleted = 0, ring = 0x52465042;
+  uint8_t  value[200];
+  uint32_t off = 0, end;
+  memset(value, 0x5A, sizeof(value));
+  if (layout == OLD_RING) {
+    uint32_t hdr[2] = { ring, 7 };
+    memcpy(sfud_sim().mem + 4096, hdr, sizeof(hdr));
+    off = 4096 + sizeof(hdr);
+    end = 5000;
+  } else {
+    end = (layout == OLD_LOG) ? 1000 : (layout == OLD_LOG_FULL) ? 5000 : 7900;
+  }
+  while (off < end) {
+    off = old_record(off, deleted, "power", "k0", value, sizeof(value));
+  }
+  for (int k = 0; k < PL_KEYS / 2; k++) {
+    off = old_record(off, active, "power", pl_key(k), value, pl_value(value, k, 0));
+  }
+  old_record(off, active, "other", "x", (const uint8_t*)"old", 3);
+}
+#endif
+
+static void pl_run_action(uint32_t cutAfter) {
+  uint8_t buf[64];
+  Preferences prefs;
+#if defined(SFUD_SIM_H)
+  sfud_sim_reset();
+  if (gPlAction == PL_MIGRATE) {
+    old_log(gPlLayout);
+    pl_cut_power(cutAfter, pl_power_cut);
+    if (!prefs.begin("power")) {
+      pl_fail("begin failed");
+    }
+    pl_no_power_cut();
+    pl_save_storage();
+    _exit(PL_DONE);
+  }
+#endif
+  if (!prefs.begin("power") || !prefs.clear()) {
+    pl_fail("setup failed");
+  }
+  for (int k = 0; k < PL_KEYS / 2; k++) {
+    size_t len = pl_value(buf, k, 0);
+    if (prefs.putBytes(pl_key(k), buf, len) != len) {
+      pl_fail("setup failed");
+    }
+  }
+
+  pl_cut_power(cutAfter, pl_power_cut);
+  if (gPlAction == PL_PUT) {
+    for (int i = 1; i <= gPlOps; i++) {
+      size_t len = pl_value(buf, gPlKey[i], i);
+      if (prefs.putBytes(pl_key(gPlKey[i]), buf, len) != len) {
+        pl_fail("put %d failed", i);
+      }
+      if (i % 8 == 0) {
+        Preferences::maintenance(1);
+      }
+    }
+  } else if (gPlAction == PL_BATCH) {
+    static uint8_t values[PL_MAX_OPS][64];
+    PreferenceEntry entries[PL_MAX_OPS];
+    for (int i = 1; i <= gPlOps; i++) {
+      entries[i - 1].key    = pl_key(gPlKey[i]);
+      entries[i - 1].value  = values[i - 1];
+      entries[i - 1].length = pl_value(values[i - 1], gPlKey[i], i);
+    }
+    if (prefs.putEntries(entries, gPlOps) != (size_t)gPlOps) {
+      pl_fail("putEntries failed");
+    }
+  } else if (!prefs.clear()) {
+    pl_fail("clear failed");
+  }
+  pl_no_power_cut();
+  pl_save_storage();
+  _exit(PL_DONE);
+}
+
+// Value number of key `k`: -1 if it's missing, -2 if it's none of its values
+static int pl_version(Preferences& prefs, int k) {
+  uint8_t buf[64], expected[64];
+  if (!prefs.isKey(pl_key(k))) {
+    return -1;
+  }
+  size_t len = prefs.getBytesLength(pl_key(k));
+  if (len > sizeof(buf) || prefs.getBytes(pl_key(k), buf, sizeof(buf)) != len) {
+    return -2;
+  }
+  for (int i = 0; i <= gPlOps; i++) {
+    if ((i == 0) ? (k < PL_KEYS / 2) : (gPlKey[i] == k && gPlAction != PL_CLEAR)) {
+      if (pl_value(expected, k, i) == len && !memcmp(buf, expected, len)) {
+        return i;
+      }
+    }
+  }
+  return -2;
+}
+
+static void pl_run_check(bool done) {
+#if defined(SFUD_SIM_H)
+  memcpy(sfud_sim().mem, gPowerLoss->flash, sizeof(gPowerLoss->flash));
+#endif
+  Preferences prefs;
+  if (!prefs.begin("power")) {
+    pl_fail("begin failed");
+  }
+  int version[PL_KEYS];
+  int last = 0;  // last op found in the storage
+  for (int k = 0; k < PL_KEYS; k++) {
+    version[k] = pl_version(prefs, k);
+    if (version[k] == -2) {
+      pl_fail("k%d is corrupt", k);
+    }
+    if (version[k] > last) {
+      last = version[k];
+    }
+  }
+
+  if (gPlAction == PL_CLEAR) {
+    int left = 0;
+    for (int k = 0; k < PL_KEYS; k++) {
+      left += (version[k] == 0);
+    }
+    if (done && left) {
+      pl_fail("%d keys left after clear()", left);
+    }
+#if defined(NVS_ATOMIC_CLEAR) || defined(NVS_PACKED)
+    if (left && left != PL_KEYS / 2) {
+      pl_fail("clear() is half done: %d keys left", left);
+    }
+#endif
+  } else {
+    for (int k = 0; k < PL_KEYS; k++) {
+      int expected = (k < PL_KEYS / 2) ? 0 : -1;
+      for (int i = 1; i <= last; i++) {
+        if (gPlKey[i] == k) {
+          expected = i;
+        }
+      }
+      if (version[k] != expected) {
+        pl_fail("k%d holds value %d instead of %d, with op %d done", k, version[k], expected, last);
+      }
+    }
+    if (done && last != gPlOps) {
+      pl_fail("only %d ops of %d done", last, gPlOps);
+    }
+#if defined(NVS_ATOMIC_BATCH)
+    if (gPlAction == PL_BATCH && last && last != gPlOps) {
+      pl_fail("putEntries() is half done: %d entries of %d", last, gPlOps);
+    }
+#endif
+  }
+
+  // The storage is still usable
+  uint8_t buf[64], read[64];
+  size_t len = pl_value(buf, 0, 1000);
+  if (prefs.putBytes("after", buf, len) != len || prefs.getBytes("after", read, sizeof(read)) != len) {
+    pl_fail("put failed after the power loss");
+  }
+#if defined(SFUD_SIM_H)
+  // Garbage collections keep the values found at boot: a leftover copy of
+  // a key mustn't come back
+  for (int n = 0; n < SFUD_SIM_CAPACITY / 64; n++) {
+    len = pl_value(buf, 0, 1001 + n);
+    if (prefs.putBytes("after", buf, len) != len) {
+      pl_fail("put failed after the power loss");
+    }
+    for (int k = 0; n % 8 == 0 && k < PL_KEYS; k++) {
+      if (pl_version(prefs, k) != version[k]) {
+        pl_fail("k%d holds value %d instead of %d after garbage collections", k, pl_version(prefs, k), version[k]);
+      }
+    }
+  }
+#endif
+  _exit(0);
+}
+
+// Runs fn(arg) in a forked process, returns its exit code
+static int pl_fork(void (*fn)(uint32_t), uint32_t arg) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    fn(arg);
+    _exit(0);
+  }
+  int status;
+  if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) {
+    return -1;
+  }
+  return WEXITSTATUS(status);
+}
+
+static void pl_check(uint32_t done) {
+  pl_run_check(done != 0);
+}
+
+static void pl_shared() {
+  if (!gPowerLoss) {
+    void* p = mmap(NULL, sizeof(PowerLossShared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    TEST_ASSERT_TRUE(p != MAP_FAILED);
+    gPowerLoss = (PowerLossShared*)p;
+  }
+}
+
+static void pl_replay(int action, int ops) {
+  pl_shared();
+  gPlAction = action;
+  gPlOps    = ops;
+
+  char msg[256];
+  for (uint32_t n = 0; ; n++) {
+    gPowerLoss->error[0] = '\0';
+    int ret = pl_fork(pl_run_action, n);
+    if (ret != PL_CUT && ret != PL_DONE) {
+      snprintf(msg, sizeof(msg), "power cut after %u changes: %s", (unsigned)n, gPowerLoss->error);
+      TEST_FAIL_MESSAGE(msg);
+    }
+    if (pl_fork(pl_check, ret == PL_DONE) != 0) {
+      snprintf(msg, sizeof(msg), "power cut after %u changes: %s", (unsigned)n, gPowerLoss->error);
+      TEST_FAIL_MESSAGE(msg);
+    }
+    if (ret == PL_DONE) {
+      break;
+    }
+    TEST_ASSERT_TRUE(n < 10000);
+  }
+}
+
+void test_power_loss_put() {
+#if defined(SFUD_SIM_H)
+  const int ops = 200;  // enough to go through garbage collections
+#else
+  const int ops = 16;
+#endif
+  for (int i = 1; i <= ops; i++) {
+    gPlKey[i] = (i - 1) % PL_KEYS;
+  }
+  pl_replay(PL_PUT, ops);
+}
+
+void test_power_loss_batch() {
+  // k2, k3 change, k4..k7 are new
+  for (int i = 1; i <= 6; i++) {
+    gPlKey[i] = i + 1;
+  }
+  pl_replay(PL_BATCH, 6);
+}
+
+void test_power_loss_clear() {
+  pl_replay(PL_CLEAR, 0);
+}
+
+#if defined(SFUD_SIM_H) && !defined(SFUD_NVS_FLASH_SIZE)
+void test_power_loss_migrate() {
+  for (gPlLayout = OLD_LOG; gPlLayout <= OLD_RING; gPlLayout++) {
+    pl_replay(PL_MIGRATE, 0);
+  }
+}
+
+// Runs in a forked process, on a fresh boot
+static void migrate_check(uint32_t layout) {
+  uint8_t buf[64], expected[64];
+  sfud_sim_reset();
+  old_log(layout);
+  Preferences prefs;
+  if (!prefs.begin("power")) {
+    pl_fail("begin failed");
+  }
+  for (int k = 0; k < PL_KEYS / 2; k++) {
+    size_t len = pl_value(expected, k, 0);
+    if (prefs.getBytes(pl_key(k), buf, sizeof(buf)) != len || memcmp(buf, expected, len)) {
+      pl_fail("k%d is lost", k);
+    }
+  }
+  if (prefs.stats().entries != PL_KEYS / 2) {
+    pl_fail("%u keys instead of %d", (unsigned)prefs.stats().entries, PL_KEYS / 2);
+  }
+  // When the converted log doesn't fit, the old one stays read-only
+  bool converted = (layout != OLD_LOG_TOO_FULL);
+  if ((prefs.putUInt("new", 1) == 4) != converted || prefs.remove("k0") != converted) {
+    pl_fail(converted ? "not writable" : "not read-only");
+  }
+  prefs.end();
+  if (!prefs.begin("other", true) || strcmp(prefs.getString("x").c_str(), "old")) {
+    pl_fail("other namespace is lost");
+  }
+  if (sfud_sim_counters().badWrites) {
+    pl_fail("programmed without an erase");
+  }
+  _exit(0);
+}
+
+void test_migrate_old_log() {
+  pl_shared();
+  for (uint32_t layout = OLD_LOG; layout <= OLD_LOG_TOO_FULL; layout++) {
+    gPowerLoss->error[0] = '\0';
+    TEST_ASSERT_EQUAL_MESSAGE(0, pl_fork(migrate_check, layout), gPowerLoss->error);
+  }
+}
+#endif
+
+#endif
+
 int runUnityTests(void) {
   UNITY_BEGIN();
 
+#if defined(TEST_POWER_LOSS)
+  // First: each replay forks processes that must boot like after a reset,
+  // without any storage state left in RAM by the other tests
+  RUN_TEST(test_power_loss_put);
+  RUN_TEST(test_power_loss_batch);
+  RUN_TEST(test_power_loss_clear);
+#if defined(SFUD_SIM_H) && !defined(SFUD_NVS_FLASH_SIZE)  // the old logs fill the default region
+  RUN_TEST(test_power_loss_migrate);
+  RUN_TEST(test_migrate_old_log);
+#endif
+#endif
+
   RUN_TEST(test_bytes);
   RUN_TEST(test_string);
   RUN_TEST(test_utf8_key);
@@ -374,6 +1305,9 @@ int runUnityTests(void) {
   RUN_TEST(test_size_mismatch_fails);
   RUN_TEST(test_readonly);
   RUN_TEST(test_begin_twice);
+#if !defined(NVS_USE_DCT) && !defined(NVS_USE_WIFININA)
+  RUN_TEST(test_begin_long_name);
+#endif
   RUN_TEST(test_put_string_object_overload);
   RUN_TEST(test_put_same_value_twice);
   RUN_TEST(test_missing_key_defaults);
@@ -382,6 +1316,24 @@ int runUnityTests(void) {
 #if !(defined(ESP32) || defined(NVS_USE_WIFININA))
   RUN_TEST(test_zero_bytes);
   RUN_TEST(test_type_reinterpret_same_size);
+  RUN_TEST(test_put_entries);
+  RUN_TEST(test_transaction);
+  RUN_TEST(test_typed_keys);
+  RUN_TEST(test_streams);
+  RUN_TEST(test_cache);
+  RUN_TEST(test_for_each);
+  RUN_TEST(test_export_import);
+  RUN_TEST(test_stats);
+  RUN_TEST(test_io_stats);
+#endif
+#if defined(NVS_USE_POSIX) && !defined(NVS_PACKED)
+  RUN_TEST(test_put_same_large_value);
+#endif
+#if !defined(ARDUINO)
+  RUN_TEST(test_no_heap_on_access);
+#endif
+#if defined(NVS_PACKED)
+  RUN_TEST(test_view);
 #endif
 
   return UNITY_END();